@@ -500,7 +500,8 @@ LUA_API const void *lua_topointer (lua_State *L, int idx) {
     case LUA_TTABLE: return hvalue(o);
     case LUA_TLCL: return clLvalue(o);
     case LUA_TCCL: return clCvalue(o);
-    case LUA_TLCF: return cast(void *, cast(size_t, fvalue(o)));
+    case LUA_TLCF: case LUA_TLLF:
+      return cast(void *, cast(size_t, fvalue(o)));
     case LUA_TTHREAD: return thvalue(o);
     case LUA_TUSERDATA:
     case LUA_TLIGHTUSERDATA:
@@ -638,6 +639,21 @@ LUA_API void lua_pushcclosure (lua_State *L, lua_CFunction fn, int n) {
   lua_unlock(L);
 }
 
+
+/*
+** push a light C function that OP_CALL may run without 'luaD_precall'
+** (a 'leaf'): it must neither yield nor call Lua functions itself. It
+** may allocate, so the collector may still run '__gc' finalizers (which
+** are Lua code) inside its frame.
+*/
+LUA_API void lua_pushleaffunction (lua_State *L, lua_CFunction fn) {
+  lua_lock(L);
+  setleafvalue(L->top, fn);
+  api_incr_top(L);
+  lua_unlock(L);
+}
+
+
 // b != 0在输入时就简化之后的判断
 LUA_API void lua_pushboolean (lua_State *L, int b) {
   lua_lock(L);
@@ -1178,6 +1194,29 @@ LUA_API int  lua_status (lua_State *L) {
 ** Garbage-collection function
 */
 
+#define usec2sec(t)	(cast(double, t) / 1e6)
+
+LUA_API void lua_getgcstats (lua_State *L, lua_GCStats *s) {
+  GCStats *gs;
+  int i;
+  lua_lock(L);
+  gs = &G(L)->gcstats;
+  s->cycles = gs->cycles;
+  s->pauses = gs->pauses;
+  s->pausetime = usec2sec(gs->pausetime);
+  s->maxpause = usec2sec(gs->maxpause);
+  s->swept = gs->swept;
+  s->propagatetime = usec2sec(gs->statetime[GCSpropagate]);
+  s->atomictime = usec2sec(gs->statetime[GCSatomic]);
+  s->sweepstringtime = usec2sec(gs->statetime[GCSsweepstring]);
+  s->sweepudatatime = usec2sec(gs->statetime[GCSsweepudata]);
+  s->sweeptime = usec2sec(gs->statetime[GCSsweep]);
+  for (i = 0; i <= LUA_TUPVAL; i++)
+    s->objects[i] = gs->objects[i];
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_gc (lua_State *L, int what, int data) {
   int res = 0;
   global_State *g;
@@ -1232,6 +1271,11 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       g->gcmajorinc = data;
       break;
     }
+    case LUA_GCSETMINORMUL: {
+      res = g->gcminormul;
+      g->gcminormul = (data > 0) ? data : 1;
+      break;
+    }
     case LUA_GCSETSTEPMUL: {
       res = g->gcstepmul;
       g->gcstepmul = data;
@@ -1249,6 +1293,40 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       luaC_changemode(L, KGC_NORMAL);
       break;
     }
+    case LUA_GCSETMARKERS: {
+      if (data < 1) data = 1;
+      else if (data > LUAI_MAXMARKERS) data = LUAI_MAXMARKERS;
+      res = luaC_setmarkers(L, data);
+      break;
+    }
+    case LUA_GCSETBGFREE: {
+      res = luaC_setfreer(L, data);
+      break;
+    }
+    case LUA_GCSETSTEPTIME: {
+      res = g->gcsteptime;
+      g->gcsteptime = (data > 0) ? data : 0;
+      g->GClasttime = 0;  /* no allocation rate measured yet */
+      break;
+    }
+    case LUA_GCSETCPUFRAC: {
+      res = g->gccpufrac;
+      if (data < 1) data = 1;
+      else if (data > 100) data = 100;
+      g->gccpufrac = data;
+      break;
+    }
+    case LUA_GCSETLIMIT: {  /* limit in Kbytes (0: no limit) */
+      res = cast_int(g->GClimit >> 10);
+      g->GClimit = (data > 0) ? cast(lu_mem, data) << 10 : 0;
+      break;
+    }
+    case LUA_GCSETTHREADPOOL: {  /* how many dead threads to keep */
+      res = g->threadpoolmax;
+      g->threadpoolmax = (data > 0) ? data : 0;
+      luaE_trimthreadpool(L, g->threadpoolmax);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1323,6 +1401,33 @@ LUA_API void lua_len (lua_State *L, int idx) {
 }
 
 
+/*
+** writes 'n' into 'buff' as '%.<prec>g' would do or, if 'prec' is
+** negative, as 'tostring' does. 'buff' must have space for at least
+** LUAI_MAXNUMBER2STR chars (plus 'prec', when it is not negative).
+*/
+LUA_API int lua_fmtnumber (lua_State *L, char *buff, lua_Number n,
+                                         int prec) {
+  UNUSED(L);
+  return luaO_fmtnum(buff, n, prec);
+}
+
+
+/*
+** sets how strings are ordered in this state; returns previous mode
+*/
+LUA_API int lua_setcollation (lua_State *L, int mode) {
+  int old;
+  lua_lock(L);
+  api_check(L, mode == LUA_COLLLOCALE || mode == LUA_COLLBYTES,
+               "invalid collation mode");
+  old = G(L)->collation;
+  G(L)->collation = cast_byte(mode);
+  lua_unlock(L);
+  return old;
+}
+
+
 LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
   lua_Alloc f;
   lua_lock(L);
@@ -1335,6 +1440,7 @@ LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
 
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
   lua_lock(L);
+  luaC_setfreer(L, 0);  /* pending blocks belong to the old allocator */
   G(L)->ud = ud;
   G(L)->frealloc = f;
   lua_unlock(L);
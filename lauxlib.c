@@ -858,6 +858,20 @@ LUALIB_API void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 }
 
 
+/*
+** set functions from list 'l' into table at top as leaf functions (see
+** 'lua_pushleaffunction'), which the VM calls with less overhead. They
+** may allocate (and so run finalizers), but must not yield or call Lua.
+*/
+LUALIB_API void luaL_setleaffuncs (lua_State *L, const luaL_Reg *l) {
+  luaL_checkversion(L);
+  for (; l->name != NULL; l++) {
+    lua_pushleaffunction(L, l->func);
+    lua_setfield(L, -2, l->name);
+  }
+}
+
+
 /*
 ** ensure that stack[idx][fname] has a table and push that table
 ** into the stack
@@ -915,6 +929,341 @@ LUALIB_API const char *luaL_gsub (lua_State *L, const char *s, const char *p,
 }
 
 
+/*
+** {======================================================
+** Slab allocator
+** =======================================================
+*/
+
+#if defined(LUA_USE_SLAB)	/* { */
+
+#include <sys/mman.h>
+
+/*
+** Small blocks (the size of most tables, closures, upvalues, short
+** strings and small node vectors) come from size classes carved out
+** of SLABPAGE-byte pages; larger blocks go to 'realloc'. All pages of
+** a state live in one range of address space reserved at creation,
+** so a block belongs to the slab if and only if it lies in that range.
+** Each page serves one class and keeps its own free list; a page that
+** becomes empty goes back to a pool shared by all classes, and pages
+** beyond SLABKEEP in that pool are returned to the system.
+*/
+
+#define SLABPAGE	(64 * 1024)
+
+#if !defined(LUAI_SLABRESERVE)
+#define LUAI_SLABRESERVE  (sizeof(void *) >= 8 ? \
+                           ((size_t)1 << 30) : ((size_t)1 << 26))
+#endif
+
+#define SLABKEEP	8	/* empty pages kept ready for reuse */
+
+/* classes: 8-byte steps up to 256 bytes, then 32-byte steps up to 512 */
+#define SLABMAX		512
+#define NSLABCLASSES	40
+
+#define sizeclass(n)  ((n) <= 256 ? ((n) + 7) / 8 - 1 : ((n) - 225) / 32 + 31)
+#define classsize(c)  ((c) < 32 ? ((c) + 1) * 8 : ((c) - 31) * 32 + 256)
+
+
+typedef struct SlabPage {
+  struct SlabPage *prev, *next;  /* pages of a class with free blocks */
+  void *free;  /* list of free blocks */
+  char *top;  /* start of the never used part of the page */
+  int nlive;  /* number of blocks in use */
+  int sc;  /* size class of its blocks */
+} SlabPage;
+
+#define PAGEHEADER	((sizeof(SlabPage) + 15) & ~(size_t)15)
+
+#define pageof(p)	((SlabPage *)((size_t)(p) & ~(size_t)(SLABPAGE - 1)))
+
+
+typedef struct Slab {
+  char *base;  /* reserved range */
+  char *limit;
+  char *top;  /* start of the never used part of the range */
+  SlabPage *partial[NSLABCLASSES];  /* pages with free blocks, per class */
+  SlabPage *empty;  /* pool of empty pages */
+  int nempty;
+  union BigBlock *big;  /* list of large blocks (only in an arena) */
+  void *state;  /* first block allocated (main block of the state) */
+  size_t inuse;  /* bytes handed out (slab and 'realloc' blocks) */
+  int arena;  /* true if slab frees everything with the state */
+  int held;  /* true while the state is being created */
+#if defined(LUA_USE_PTHREADS)
+  volatile int lock;  /* collector may free blocks from another thread */
+#endif
+} Slab;
+
+#if defined(LUA_USE_PTHREADS)
+#define lockslab(s)	while (__sync_lock_test_and_set(&(s)->lock, 1)) ;
+#define unlockslab(s)	__sync_lock_release(&(s)->lock)
+#else
+#define lockslab(s)	((void)0)
+#define unlockslab(s)	((void)0)
+#endif
+
+
+static SlabPage *newpage (Slab *s, int sc) {
+  SlabPage *p = s->empty;
+  if (p != NULL) {  /* reuse an empty page */
+    s->empty = p->next;
+    s->nempty--;
+  }
+  else if (s->limit - s->top >= SLABPAGE) {  /* take a fresh page */
+    p = (SlabPage *)s->top;
+    s->top += SLABPAGE;
+  }
+  else return NULL;  /* range exhausted; caller uses 'realloc' */
+  p->prev = NULL;
+  p->next = s->partial[sc];
+  if (p->next) p->next->prev = p;
+  s->partial[sc] = p;
+  p->free = NULL;
+  p->top = (char *)p + PAGEHEADER;
+  p->nlive = 0;
+  p->sc = sc;
+  return p;
+}
+
+
+static void unlinkpage (Slab *s, SlabPage *p) {
+  if (p->prev) p->prev->next = p->next;
+  else s->partial[p->sc] = p->next;
+  if (p->next) p->next->prev = p->prev;
+}
+
+
+static void *slaballoc (Slab *s, size_t size) {
+  int sc = sizeclass(size);
+  SlabPage *p = s->partial[sc];
+  void *block;
+  if (p == NULL && (p = newpage(s, sc)) == NULL)
+    return NULL;
+  if (p->free != NULL) {
+    block = p->free;
+    p->free = *(void **)block;
+  }
+  else {
+    block = p->top;
+    p->top += classsize(sc);
+  }
+  if (p->free == NULL && p->top + classsize(sc) > (char *)p + SLABPAGE)
+    unlinkpage(s, p);  /* page is full */
+  p->nlive++;
+  return block;
+}
+
+
+static void slabfree (Slab *s, void *block) {
+  SlabPage *p = pageof(block);
+  int sc = p->sc;
+  if (p->free == NULL && p->top + classsize(sc) > (char *)p + SLABPAGE) {
+    p->prev = NULL;  /* page was full; make it available again */
+    p->next = s->partial[sc];
+    if (p->next) p->next->prev = p;
+    s->partial[sc] = p;
+  }
+  *(void **)block = p->free;
+  p->free = block;
+  if (--p->nlive == 0) {  /* page is empty? */
+    unlinkpage(s, p);
+    if (s->nempty >= SLABKEEP)  /* pool is full? */
+      madvise(p, SLABPAGE, MADV_DONTNEED);  /* give memory back */
+    p->next = s->empty;
+    s->empty = p;
+    s->nempty++;
+  }
+}
+
+
+#define inslab(s,p)	((char *)(p) >= (s)->base && (char *)(p) < (s)->limit)
+
+
+/*
+** In an arena, large blocks carry a header linking them in a list, so
+** that the whole arena can be freed without help from the state
+*/
+typedef union BigBlock {
+  struct {
+    union BigBlock *prev, *next;
+  } l;
+  double u; void *p; long n;  /* ensure maximum alignment for the block */
+} BigBlock;
+
+#define bigheader(s)	((s)->arena ? sizeof(BigBlock) : 0)
+
+
+static void linkbig (Slab *s, BigBlock *b) {
+  b->l.prev = NULL;
+  b->l.next = s->big;
+  if (s->big) s->big->l.prev = b;
+  s->big = b;
+}
+
+
+static void unlinkbig (Slab *s, BigBlock *b) {
+  if (b->l.prev) b->l.prev->l.next = b->l.next;
+  else s->big = b->l.next;
+  if (b->l.next) b->l.next->l.prev = b->l.prev;
+}
+
+
+static void *bigrealloc (Slab *s, void *block, size_t size) {
+  BigBlock *b = (block && s->arena) ? (BigBlock *)block - 1 : NULL;
+  BigBlock *nb;
+  if (!s->arena)
+    return realloc(block, size);
+  if (b) unlinkbig(s, b);
+  nb = (BigBlock *)realloc(b, sizeof(BigBlock) + size);
+  if (nb == NULL) {
+    if (b) linkbig(s, b);  /* old block is still valid */
+    return NULL;
+  }
+  linkbig(s, nb);
+  return nb + 1;
+}
+
+
+static void bigfree (Slab *s, void *block) {
+  if (s->arena && block != NULL) {
+    unlinkbig(s, (BigBlock *)block - 1);
+    block = (BigBlock *)block - 1;
+  }
+  free(block);
+}
+
+
+static void *resize (Slab *s, void *ptr, size_t osize, size_t nsize) {
+  void *nb;
+  if (ptr == NULL)  /* new block ('osize' is the kind of object) */
+    return (nsize <= SLABMAX && (nb = slaballoc(s, nsize)) != NULL)
+           ? nb : bigrealloc(s, NULL, nsize);
+  else if (!inslab(s, ptr)) {  /* a 'realloc' block? */
+    if (nsize > SLABMAX || (nb = slaballoc(s, nsize)) == NULL)
+      return bigrealloc(s, ptr, nsize);
+    memcpy(nb, ptr, (osize < nsize) ? osize : nsize);
+    bigfree(s, ptr);
+    return nb;
+  }
+  else if (nsize <= SLABMAX && (int)sizeclass(nsize) == pageof(ptr)->sc)
+    return ptr;  /* still fits in the same class */
+  else {
+    nb = (nsize <= SLABMAX) ? slaballoc(s, nsize) : NULL;
+    if (nb == NULL && (nb = bigrealloc(s, NULL, nsize)) == NULL)
+      return (nsize < osize) ? ptr : NULL;  /* shrinking cannot fail */
+    memcpy(nb, ptr, (osize < nsize) ? osize : nsize);
+    slabfree(s, ptr);
+    return nb;
+  }
+}
+
+
+/*
+** A slab goes away together with its state: with its last block, or,
+** in an arena, with the main block of the state (the first block it
+** allocated), whatever else is still in use. While the state is being
+** created, 'held' keeps the slab alive; 'slabstate' then drops it.
+*/
+static void dropslab (Slab *s) {
+  while (s->big != NULL) {
+    BigBlock *b = s->big;
+    s->big = b->l.next;
+    free(b);
+  }
+  munmap(s->base, s->limit - s->base);
+  free(s);
+}
+
+
+static void *slab_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  Slab *s = (Slab *)ud;
+  void *nb = NULL;
+  int gone;
+  lockslab(s);
+  if (nsize == 0) {
+    if (s->arena && ptr == s->state && !s->held) {  /* arena is closing? */
+      unlockslab(s);
+      dropslab(s);
+      return NULL;
+    }
+    if (inslab(s, ptr)) slabfree(s, ptr);
+    else bigfree(s, ptr);
+  }
+  else if ((nb = resize(s, ptr, osize, nsize)) == NULL) {
+    unlockslab(s);
+    return NULL;
+  }
+  else if (s->state == NULL)
+    s->state = nb;  /* first block is the state itself */
+  if (ptr != NULL) s->inuse -= osize;
+  s->inuse += nsize;
+  gone = (s->inuse == 0 && !s->held);
+  unlockslab(s);
+  if (gone)  /* state is gone? */
+    dropslab(s);
+  return nb;
+}
+
+
+/*
+** reserve the address space for a new slab; returns NULL if that fails
+*/
+static Slab *newslab (int arena) {
+  Slab *s = (Slab *)malloc(sizeof(Slab));
+  char *base;
+  int i;
+  if (s == NULL) return NULL;
+  /* reserve address space; pages use memory only when touched */
+  base = (char *)mmap(NULL, LUAI_SLABRESERVE + SLABPAGE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (base == (char *)MAP_FAILED) {
+    free(s);
+    return NULL;
+  }
+  s->base = base;
+  s->limit = base + LUAI_SLABRESERVE + SLABPAGE;
+  s->top = (char *)(((size_t)base + SLABPAGE - 1) & ~(size_t)(SLABPAGE - 1));
+  for (i = 0; i < NSLABCLASSES; i++) s->partial[i] = NULL;
+  s->empty = NULL;
+  s->nempty = 0;
+  s->big = NULL;
+  s->state = NULL;
+  s->inuse = 0;
+  s->arena = arena;
+  s->held = 1;
+#if defined(LUA_USE_PTHREADS)
+  s->lock = 0;
+#endif
+  return s;
+}
+
+
+/*
+** create a state (a copy of 'from', if not NULL) inside slab 's'. A
+** failure here is not retried with another allocator: a copy may have
+** already called '__clone' hooks.
+*/
+static lua_State *slabstate (Slab *s, lua_State *from) {
+  lua_State *L;
+  if (from != NULL)
+    L = lua_clonestate(from, slab_alloc, s);
+  else
+    L = s->arena ? lua_newarena(slab_alloc, s) : lua_newstate(slab_alloc, s);
+  s->held = 0;
+  if (L == NULL)  /* creation failed? (all its memory is already freed) */
+    dropslab(s);
+  return L;
+}
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
 static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
   (void)ud; (void)osize;  /* not used */
   if (nsize == 0) {
@@ -934,12 +1283,56 @@ static int panic (lua_State *L) {
 
 
 LUALIB_API lua_State *luaL_newstate (void) {
-  lua_State *L = lua_newstate(l_alloc, NULL);
+  lua_State *L;
+#if defined(LUA_USE_SLAB)
+  Slab *s = newslab(0);
+  if (s != NULL)
+    L = slabstate(s, NULL);
+  else  /* no address space; use plain 'realloc' */
+#endif
+  L = lua_newstate(l_alloc, NULL);
   if (L) lua_atpanic(L, &panic);
   return L;
 }
 
 
+/*
+** Like 'luaL_newstate', but 'lua_close' releases all memory of the
+** state at once, after calling its pending finalizers. Without a slab
+** the state is closed as usual.
+*/
+LUALIB_API lua_State *luaL_newarena (void) {
+  lua_State *L;
+#if defined(LUA_USE_SLAB)
+  Slab *s = newslab(1);
+  if (s != NULL)
+    L = slabstate(s, NULL);
+  else
+#endif
+  L = lua_newstate(l_alloc, NULL);
+  if (L) lua_atpanic(L, &panic);
+  return L;
+}
+
+
+/*
+** New state with a copy of the heap of 'from' (see 'lua_clonestate'),
+** using the same kind of allocator as 'luaL_newstate'. On errors,
+** returns NULL with the error message on the stack of 'from'.
+*/
+LUALIB_API lua_State *luaL_clonestate (lua_State *from) {
+  lua_State *L;
+#if defined(LUA_USE_SLAB)
+  Slab *s = newslab(0);
+  if (s != NULL)
+    L = slabstate(s, from);
+  else
+#endif
+  L = lua_clonestate(from, l_alloc, NULL);
+  return L;
+}
+
+
 LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver) {
   const lua_Number *v = lua_version(L);
   if (v != lua_version(NULL))
@@ -82,6 +82,8 @@ LUALIB_API int (luaL_loadbufferx) (lua_State *L, const char *buff, size_t sz,
 LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
 
 LUALIB_API lua_State *(luaL_newstate) (void);
+LUALIB_API lua_State *(luaL_newarena) (void);
+LUALIB_API lua_State *(luaL_clonestate) (lua_State *from);
 
 LUALIB_API int (luaL_len) (lua_State *L, int idx);
 
@@ -89,6 +91,7 @@ LUALIB_API const char *(luaL_gsub) (lua_State *L, const char *s, const char *p,
                                                   const char *r);
 
 LUALIB_API void (luaL_setfuncs) (lua_State *L, const luaL_Reg *l, int nup);
+LUALIB_API void (luaL_setleaffuncs) (lua_State *L, const luaL_Reg *l);
 
 LUALIB_API int (luaL_getsubtable) (lua_State *L, int idx, const char *fname);
 
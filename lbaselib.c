@@ -157,16 +157,80 @@ static int luaB_rawset (lua_State *L) {
 }
 
 
+/* 'collectgarbage' option handled by 'lua_getgcstats' (not by 'lua_gc') */
+#define GCSTATS		(-1)
+
+
+static void setfield (lua_State *L, const char *k, lua_Number v) {
+  lua_pushnumber(L, v);
+  lua_setfield(L, -2, k);
+}
+
+
+static int gcstats (lua_State *L) {
+  static const char *const objnames[] = {"proto", "upvalue"};
+  lua_GCStats s;
+  int i;
+  lua_getgcstats(L, &s);
+  lua_createtable(L, 0, 7);
+  setfield(L, "cycles", (lua_Number)s.cycles);
+  setfield(L, "pauses", (lua_Number)s.pauses);
+  setfield(L, "pausetime", s.pausetime);
+  setfield(L, "maxpause", s.maxpause);
+  setfield(L, "swept", (lua_Number)s.swept);
+  lua_createtable(L, 0, 5);  /* time spent in each state */
+  setfield(L, "propagate", s.propagatetime);
+  setfield(L, "atomic", s.atomictime);
+  setfield(L, "sweepstring", s.sweepstringtime);
+  setfield(L, "sweepudata", s.sweepudatatime);
+  setfield(L, "sweep", s.sweeptime);
+  lua_setfield(L, -2, "time");
+  lua_createtable(L, 0, 7);  /* live objects by type */
+  for (i = 0; i < LUA_NUMTAGS + 2; i++) {
+    if (s.objects[i] > 0)
+      setfield(L, (i < LUA_NUMTAGS) ? lua_typename(L, i)
+                                    : objnames[i - LUA_NUMTAGS],
+                  (lua_Number)s.objects[i]);
+  }
+  lua_setfield(L, -2, "objects");
+  return 1;
+}
+
+
+/*
+** scripts may set or lower the memory limit, but not raise or remove
+** it; that is left to the host ('lua_gc' with LUA_GCSETLIMIT)
+*/
+static int setlimit (lua_State *L, int limit) {
+  int old = lua_gc(L, LUA_GCSETLIMIT, limit);
+  if (old > 0 && (limit <= 0 || limit > old)) {  /* not lowering it? */
+    lua_gc(L, LUA_GCSETLIMIT, old);  /* restore old limit */
+    return luaL_argerror(L, 2, "cannot raise the memory limit");
+  }
+  lua_pushinteger(L, old);
+  return 1;
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "setmajorinc", "isrunning", "generational", "incremental", NULL};
+    "setmajorinc", "setminormul", "isrunning", "generational", "incremental",
+    "setmarkers", "setsteptime", "setcpufrac", "setlimit",
+    "setthreadpool", "stats", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCSETMAJORINC, LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC};
+    LUA_GCSETMAJORINC, LUA_GCSETMINORMUL, LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC,
+    LUA_GCSETMARKERS, LUA_GCSETSTEPTIME, LUA_GCSETCPUFRAC,
+    LUA_GCSETLIMIT, LUA_GCSETTHREADPOOL, GCSTATS};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   int ex = luaL_optint(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int res;
+  if (o == GCSTATS)
+    return gcstats(L);
+  else if (o == LUA_GCSETLIMIT)
+    return setlimit(L, ex);
+  res = lua_gc(L, o, ex);
   switch (o) {
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
@@ -431,16 +495,22 @@ static const luaL_Reg base_funcs[] = {
   {"pairs", luaB_pairs},
   {"pcall", luaB_pcall},
   {"print", luaB_print},
+  {"setmetatable", luaB_setmetatable},
+  {"tostring", luaB_tostring},
+  {"xpcall", luaB_xpcall},
+  {NULL, NULL}
+};
+
+
+/* functions that neither yield nor call Lua (see 'luaL_setleaffuncs') */
+static const luaL_Reg base_leaf[] = {
   {"rawequal", luaB_rawequal},
   {"rawlen", luaB_rawlen},
   {"rawget", luaB_rawget},
   {"rawset", luaB_rawset},
   {"select", luaB_select},
-  {"setmetatable", luaB_setmetatable},
   {"tonumber", luaB_tonumber},
-  {"tostring", luaB_tostring},
   {"type", luaB_type},
-  {"xpcall", luaB_xpcall},
   {NULL, NULL}
 };
 
@@ -452,6 +522,9 @@ LUAMOD_API int luaopen_base (lua_State *L) {
   lua_setfield(L, -2, "_G");
   /* open lib into global table */
   luaL_setfuncs(L, base_funcs, 0);
+  luaL_setleaffuncs(L, base_leaf);
+  lua_getfield(L, -1, "select");  /* let the VM run 'select(n, ...)' */
+  lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_SELECT);
   lua_pushliteral(L, LUA_VERSION);
   lua_setfield(L, -2, "_VERSION");  /* set global _VERSION */
   return 1;
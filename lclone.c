@@ -0,0 +1,459 @@
+/*
+** $Id: lclone.c $
+** Copy the heap of a state into a new state
+** See Copyright Notice in lua.h
+*/
+
+#include <string.h>
+
+#define lclone_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "lclone.h"
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+
+
+/*
+** Everything reachable from the registry and from the basic metatables
+** of the template is copied; the template is only read, so several
+** states may be cloned from it at the same time (as long as it does
+** not run). Each object is first created empty and recorded in 'map'
+** (a hash from the original to the copy, with linear probing); the
+** pair is also queued and filled in afterwards, so that deep structures
+** do not use the C stack. The collector of the new state is stopped
+** meanwhile.
+**
+** Tables keep their sizes, and, when no key depends on an address,
+** their exact node layout, so that 'next' visits the keys in the same
+** order. Coroutines cannot be copied.
+**
+** Userdata are copied byte by byte, which is only right when their
+** bytes hold no addresses (of their own memory, of other objects, or
+** of resources owned by the template). A library tells that with a
+** '__clone' field in the metatable: true means the bytes can be used
+** as they are; a function is called with each copy, in the new state,
+** to fix it (for instance, to drop a cache or to detach it from a
+** file of the template). Userdata with a metatable or a uservalue but
+** no '__clone' cannot be copied; plain userdata can.
+*/
+
+typedef struct CloneEntry {
+  GCObject *o;  /* original */
+  GCObject *c;  /* its copy */
+} CloneEntry;
+
+
+typedef struct CloneState {
+  lua_State *L;  /* new state */
+  lua_State *from;  /* template */
+  CloneEntry *map;  /* hash part (size 'sizemap', a power of 2) */
+  CloneEntry *queue;  /* entries in order of creation */
+  int sizemap;
+  int sizequeue;
+  int n;  /* number of entries in 'map' */
+  int nqueue;  /* number of entries in 'queue' */
+} CloneState;
+
+
+#define MINCLONEMAP	256
+
+#define mapslot(cs,o)	cast_int(IntPoint(o) % (((cs)->sizemap - 1) | 1))
+
+
+static CloneEntry *findentry (CloneState *cs, GCObject *o) {
+  int i = mapslot(cs, o);
+  while (cs->map[i].o != o && cs->map[i].o != NULL)
+    i = (i + 1) & (cs->sizemap - 1);  /* linear probing */
+  return &cs->map[i];
+}
+
+
+static void resizemap (CloneState *cs, int size) {
+  int oldsize = cs->sizemap;
+  CloneEntry *old = cs->map;
+  int i;
+  cs->map = luaM_newvector(cs->L, size, CloneEntry);
+  for (i = 0; i < size; i++) cs->map[i].o = NULL;
+  cs->sizemap = size;
+  for (i = 0; i < oldsize; i++) {  /* re-insert old entries */
+    if (old[i].o != NULL)
+      *findentry(cs, old[i].o) = old[i];
+  }
+  luaM_freearray(cs->L, old, oldsize);
+}
+
+
+/*
+** record that 'c' is the copy of 'o'; if 'fill', queue it to be filled
+*/
+static void record (CloneState *cs, GCObject *o, GCObject *c, int fill) {
+  CloneEntry *e;
+  if (cs->n >= cs->sizemap / 2)  /* keep load factor below 1/2 */
+    resizemap(cs, (cs->sizemap == 0) ? MINCLONEMAP : 2 * cs->sizemap);
+  e = findentry(cs, o);
+  e->o = o;
+  e->c = c;
+  if (fill) {
+    luaM_growvector(cs->L, cs->queue, cs->nqueue, cs->sizequeue, CloneEntry,
+                    MAX_INT, "objects");
+    cs->queue[cs->nqueue++] = *e;
+  }
+  cs->n++;
+}
+
+
+static GCObject *cloneobj (CloneState *cs, GCObject *o);
+
+
+static void clonevalue (CloneState *cs, TValue *to, const TValue *from) {
+  GCObject *c;
+  if (!iscollectable(from)) {
+    setobj(cs->L, to, from);
+    return;
+  }
+  c = cloneobj(cs, gcvalue(from));
+  switch (ttype(from)) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR: setsvalue(cs->L, to, rawgco2ts(c)); break;
+    case LUA_TTABLE: sethvalue(cs->L, to, gco2t(c)); break;
+    case LUA_TLCL: setclLvalue(cs->L, to, gco2cl(c)); break;
+    case LUA_TCCL: setclCvalue(cs->L, to, gco2cl(c)); break;
+    case LUA_TUSERDATA: setuvalue(cs->L, to, rawgco2u(c)); break;
+    case LUA_TTHREAD: setthvalue(cs->L, to, gco2th(c)); break;
+    default: lua_assert(0);
+  }
+}
+
+
+#define cloneref(cs,x,t)	((x) ? gco2##t(cloneobj(cs, obj2gco(x))) : NULL)
+#define clonestr(cs,x)	((x) ? rawgco2ts(cloneobj(cs, obj2gco(x))) : NULL)
+
+
+/*
+** create an empty copy of 'o' (or return the one already created)
+*/
+static GCObject *cloneobj (CloneState *cs, GCObject *o) {
+  lua_State *L = cs->L;
+  GCObject *c;
+  if (cs->sizemap > 0) {
+    CloneEntry *e = findentry(cs, o);
+    if (e->o != NULL)  /* already copied? */
+      return e->c;
+  }
+  switch (gch(o)->tt) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR: {
+      TString *ts = rawgco2ts(o);
+      TString *nts = luaS_newlstr(L, getstr(ts), ts->tsv.len);
+      if (ts->tsv.tt == LUA_TSHRSTR)
+        return obj2gco(nts);  /* interned; no need to record it */
+      nts->tsv.hash = ts->tsv.hash;  /* keep (lazy) hash of long string */
+      nts->tsv.extra = ts->tsv.extra;
+      record(cs, o, obj2gco(nts), 0);  /* nothing to fill */
+      return obj2gco(nts);
+    }
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      Table *t = luaH_new(L);
+      luaH_resize(L, t, h->sizearray,
+                  luaH_isdummy(h->node) ? 0 : sizenode(h));
+      c = obj2gco(t);
+      break;
+    }
+    case LUA_TLCL: {
+      Closure *cl = luaF_newLclosure(L, gco2lcl(o)->nupvalues);
+      int i;
+      for (i = 0; i < cl->l.nupvalues; i++) cl->l.upvals[i] = NULL;
+      c = obj2gco(cl);
+      break;
+    }
+    case LUA_TCCL: {
+      Closure *cl = luaF_newCclosure(L, gco2ccl(o)->nupvalues);
+      int i;
+      cl->c.f = gco2ccl(o)->f;
+      for (i = 0; i < cl->c.nupvalues; i++) setnilvalue(&cl->c.upvalue[i]);
+      c = obj2gco(cl);
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = rawgco2u(o);
+      Udata *nu = luaS_newudata(L, u->uv.len, NULL);
+      memcpy(nu + 1, u + 1, u->uv.len);
+      c = obj2gco(nu);
+      break;
+    }
+    case LUA_TPROTO: c = obj2gco(luaF_newproto(L)); break;
+    case LUA_TUPVAL: c = obj2gco(luaF_newupval(L)); break;
+    case LUA_TTHREAD: {
+      /* the main thread is recorded in advance */
+      luaG_runerror(L, "cannot clone a state with coroutines");
+    }
+    default: lua_assert(0); return NULL;
+  }
+  record(cs, o, c, 1);
+  return c;
+}
+
+
+static void clonetable (CloneState *cs, Table *h, Table *t) {
+  int i;
+  int size = luaH_isdummy(h->node) ? 0 : sizenode(h);
+  int samelayout = 1;
+  t->metatable = cloneref(cs, h->metatable, t);
+  t->flags = h->flags;
+  for (i = 0; i < h->sizearray; i++)
+    clonevalue(cs, &t->array[i], &h->array[i]);
+  for (i = 0; i < size; i++) {
+    const TValue *key = gkey(gnode(h, i));
+    if (!ttisnil(gval(gnode(h, i))) && iscollectable(key) && !ttisstring(key))
+      samelayout = 0;  /* position of this key depends on an address */
+  }
+  if (samelayout) {  /* copy nodes and their chains as they are */
+    for (i = 0; i < size; i++) {
+      Node *sn = gnode(h, i);
+      Node *dn = gnode(t, i);
+      if (!ttisnil(gval(sn))) {
+        clonevalue(cs, gkey(dn), gkey(sn));
+        clonevalue(cs, gval(dn), gval(sn));
+      }
+      else if (iscollectable(gkey(sn)) || ttisdeadkey(gkey(sn))) {
+        val_(gkey(dn)).gc = NULL;  /* removed entry; keep it in its chain */
+        setdeadvalue(gkey(dn));
+      }
+      else
+        setobj(cs->L, gkey(dn), gkey(sn));
+      gnext(dn) = (gnext(sn) == NULL) ? NULL
+                                      : gnode(t, gnext(sn) - gnode(h, 0));
+    }
+    t->lastfree = gnode(t, h->lastfree - gnode(h, 0));
+  }
+  else {  /* insert keys again (same sizes, so there is always room) */
+    for (i = 0; i < size; i++) {
+      Node *sn = gnode(h, i);
+      if (!ttisnil(gval(sn))) {
+        TValue k, v;
+        clonevalue(cs, &k, gkey(sn));
+        clonevalue(cs, &v, gval(sn));
+        setobj2t(cs->L, luaH_set(cs->L, t, &k), &v);
+      }
+    }
+  }
+}
+
+
+static void cloneproto (CloneState *cs, Proto *f, Proto *nf) {
+  lua_State *L = cs->L;
+  int i;
+  nf->code = luaM_newvector(L, f->sizecode, Instruction);
+  memcpy(nf->code, f->code, f->sizecode * sizeof(Instruction));
+  nf->sizecode = f->sizecode;
+  nf->lineinfo = luaM_newvector(L, f->sizelineinfo, int);
+  memcpy(nf->lineinfo, f->lineinfo, f->sizelineinfo * sizeof(int));
+  nf->sizelineinfo = f->sizelineinfo;
+  nf->k = luaM_newvector(L, f->sizek, TValue);
+  for (i = 0; i < f->sizek; i++) setnilvalue(&nf->k[i]);
+  nf->sizek = f->sizek;
+  nf->p = luaM_newvector(L, f->sizep, Proto *);
+  for (i = 0; i < f->sizep; i++) nf->p[i] = NULL;
+  nf->sizep = f->sizep;
+  nf->locvars = luaM_newvector(L, f->sizelocvars, LocVar);
+  for (i = 0; i < f->sizelocvars; i++) nf->locvars[i].varname = NULL;
+  nf->sizelocvars = f->sizelocvars;
+  nf->upvalues = luaM_newvector(L, f->sizeupvalues, Upvaldesc);
+  for (i = 0; i < f->sizeupvalues; i++) nf->upvalues[i].name = NULL;
+  nf->sizeupvalues = f->sizeupvalues;
+  /* all vectors allocated; now fill them (which may create objects) */
+  for (i = 0; i < f->sizek; i++)
+    clonevalue(cs, &nf->k[i], &f->k[i]);
+  for (i = 0; i < f->sizep; i++)
+    nf->p[i] = cloneref(cs, f->p[i], p);
+  for (i = 0; i < f->sizelocvars; i++) {
+    nf->locvars[i].varname = clonestr(cs, f->locvars[i].varname);
+    nf->locvars[i].startpc = f->locvars[i].startpc;
+    nf->locvars[i].endpc = f->locvars[i].endpc;
+  }
+  for (i = 0; i < f->sizeupvalues; i++) {
+    nf->upvalues[i].name = clonestr(cs, f->upvalues[i].name);
+    nf->upvalues[i].instack = f->upvalues[i].instack;
+    nf->upvalues[i].idx = f->upvalues[i].idx;
+  }
+  nf->source = clonestr(cs, f->source);
+  nf->linedefined = f->linedefined;
+  nf->lastlinedefined = f->lastlinedefined;
+  nf->numparams = f->numparams;
+  nf->is_vararg = f->is_vararg;
+  nf->maxstacksize = f->maxstacksize;
+}
+
+
+/*
+** fill the copy 'c' of object 'o'
+*/
+static void fill (CloneState *cs, GCObject *o, GCObject *c) {
+  int i;
+  switch (gch(o)->tt) {
+    case LUA_TTABLE: clonetable(cs, gco2t(o), gco2t(c)); break;
+    case LUA_TLCL: {
+      LClosure *cl = gco2lcl(o);
+      gco2lcl(c)->p = cloneref(cs, cl->p, p);
+      for (i = 0; i < cl->nupvalues; i++)
+        gco2lcl(c)->upvals[i] = cloneref(cs, cl->upvals[i], uv);
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      for (i = 0; i < cl->nupvalues; i++)
+        clonevalue(cs, &gco2ccl(c)->upvalue[i], &cl->upvalue[i]);
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = rawgco2u(o);
+      rawgco2u(c)->uv.metatable = cloneref(cs, u->uv.metatable, t);
+      rawgco2u(c)->uv.env = cloneref(cs, u->uv.env, t);
+      break;
+    }
+    case LUA_TPROTO: cloneproto(cs, gco2p(o), gco2p(c)); break;
+    case LUA_TUPVAL: {  /* an open upvalue is copied closed */
+      clonevalue(cs, &gco2uv(c)->u.value, gco2uv(o)->v);
+      break;
+    }
+    default: lua_assert(0);
+  }
+  /* objects marked for finalization in template are also in the copy */
+  if (testbit(gch(o)->marked, SEPARATED) && !testbit(gch(o)->marked, FINALIZEDBIT))
+    l_setbit(gch(c)->marked, SEPARATED);
+}
+
+
+/*
+** move copies marked for finalization from 'allgc' to 'finobj' (as
+** 'luaC_checkfinalizer' does, but in one pass)
+*/
+static void separatecopies (global_State *g) {
+  GCObject **p = &g->allgc;
+  GCObject **lastnext = &g->finobj;
+  GCObject *curr;
+  while (*lastnext != NULL)
+    lastnext = &gch(*lastnext)->next;
+  while ((curr = *p) != NULL) {
+    if (testbit(gch(curr)->marked, SEPARATED)) {
+      *p = gch(curr)->next;  /* remove 'curr' from 'allgc' list */
+      gch(curr)->next = NULL;
+      *lastnext = curr;  /* link at the end of 'finobj' list */
+      lastnext = &gch(curr)->next;
+    }
+    else p = &gch(curr)->next;
+  }
+}
+
+
+/*
+** number of objects of the template that will be recorded (all but
+** short strings)
+*/
+static int countobjs (global_State *g) {
+  GCObject *o;
+  int n = 0;
+  for (o = g->allgc; o != NULL && n < MAX_INT / 4; o = gch(o)->next) n++;
+  for (o = g->finobj; o != NULL && n < MAX_INT / 4; o = gch(o)->next) n++;
+  return n;
+}
+
+
+/*
+** check each copied userdata and call the '__clone' hooks. No
+** finalizer runs if this fails, as copies are not in 'finobj' yet.
+*/
+static void fixudata (lua_State *L, void *ud) {
+  CloneState *cs = cast(CloneState *, ud);
+  TString *name = luaS_newliteral(L, "__clone");
+  int i;
+  for (i = 0; i < cs->nqueue; i++) {
+    Udata *u;
+    const TValue *hook;
+    if (gch(cs->queue[i].c)->tt != LUA_TUSERDATA) continue;
+    u = rawgco2u(cs->queue[i].c);
+    if (u->uv.metatable == NULL && u->uv.env == NULL)
+      continue;  /* plain userdata */
+    hook = (u->uv.metatable == NULL) ? luaO_nilobject
+                                     : luaH_getstr(u->uv.metatable, name);
+    if (ttisfunction(hook)) {
+      luaD_checkstack(L, 2);
+      setobj2s(L, L->top, hook);
+      setuvalue(L, L->top + 1, u);
+      L->top += 2;
+      luaD_call(L, L->top - 2, 0, 0);
+    }
+    else if (l_isfalse(hook))
+      luaG_runerror(L, "cannot clone a userdata without '__clone'");
+  }
+}
+
+
+static void copyheap (lua_State *L, void *ud) {
+  CloneState *cs = cast(CloneState *, ud);
+  global_State *g = G(L);
+  global_State *fg = G(cs->from);
+  int n = countobjs(fg);
+  int i;
+  luaC_setmarkers(L, fg->gcmarkers);
+  if (g->strt.size < fg->strt.size)  /* avoid rehashing strings */
+    luaS_resize(L, fg->strt.size);
+  /* presize to avoid rehashing the map */
+  resizemap(cs, twoto(luaO_ceillog2(cast(unsigned int, 2 * n + 1))));
+  cs->queue = luaM_newvector(L, n, CloneEntry);
+  cs->sizequeue = n;
+  record(cs, obj2gco(fg->mainthread), obj2gco(L), 0);
+  clonevalue(cs, &g->l_registry, &fg->l_registry);
+  for (i = 0; i < LUA_NUMTAGS; i++)
+    g->mt[i] = cloneref(cs, fg->mt[i], t);
+  for (i = 0; i < cs->nqueue; i++)  /* fill all queued objects */
+    fill(cs, cs->queue[i].o, cs->queue[i].c);
+}
+
+
+/*
+** copy into 'L' (a new state) the heap of 'from'; returns the status
+** of the copy (an error leaves 'L' to be closed)
+*/
+int luaE_clone (lua_State *L, lua_State *from) {
+  global_State *g = G(L);
+  global_State *fg = G(from);
+  CloneState cs;
+  int status;
+  cs.L = L;
+  cs.from = from;
+  cs.map = cs.queue = NULL;
+  cs.sizemap = cs.sizequeue = cs.n = cs.nqueue = 0;
+  g->gcrunning = 0;  /* no collections while copying */
+  status = luaD_rawrunprotected(L, copyheap, &cs);
+  if (status == LUA_OK)
+    status = luaD_rawrunprotected(L, fixudata, &cs);
+  luaM_freearray(L, cs.map, cs.sizemap);
+  luaM_freearray(L, cs.queue, cs.sizequeue);
+  if (status != LUA_OK) return status;
+  separatecopies(g);
+  g->panic = fg->panic;
+  g->gcpause = fg->gcpause;
+  g->gcmajorinc = fg->gcmajorinc;
+  g->gcminormul = fg->gcminormul;
+  g->gcstepmul = fg->gcstepmul;
+  g->gcsteptime = fg->gcsteptime;
+  g->gccpufrac = fg->gccpufrac;
+  g->GClimit = fg->GClimit;
+  g->threadpoolmax = fg->threadpoolmax;
+  g->collation = fg->collation;
+  g->gcrunning = 1;
+  if (fg->gckind == KGC_GEN)
+    luaC_changemode(L, KGC_GEN);
+  return LUA_OK;
+}
+
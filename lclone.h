@@ -0,0 +1,15 @@
+/*
+** $Id: lclone.h $
+** Copy the heap of a state into a new state
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lclone_h
+#define lclone_h
+
+#include "lstate.h"
+
+
+LUAI_FUNC int luaE_clone (lua_State *L, lua_State *from);
+
+#endif
@@ -370,7 +370,30 @@ static int db_traceback (lua_State *L) {
 }
 
 
+static int writer (lua_State *L, const void *b, size_t size, void *B) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)B, (const char *)b, size);
+  return 0;
+}
+
+
+static int db_setallocprof (lua_State *L) {
+  lua_pushinteger(L, lua_setallocprof(L, luaL_checkint(L, 1)));
+  return 1;
+}
+
+
+static int db_allocprofile (lua_State *L) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  lua_dumpallocprof(L, writer, &b);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
 static const luaL_Reg dblib[] = {
+  {"allocprofile", db_allocprofile},
   {"debug", db_debug},
   {"getuservalue", db_getuservalue},
   {"gethook", db_gethook},
@@ -382,6 +405,7 @@ static const luaL_Reg dblib[] = {
   {"upvaluejoin", db_upvaluejoin},
   {"upvalueid", db_upvalueid},
   {"setuservalue", db_setuservalue},
+  {"setallocprof", db_setallocprof},
   {"sethook", db_sethook},
   {"setlocal", db_setlocal},
   {"setmetatable", db_setmetatable},
@@ -7,6 +7,7 @@
 
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 
 
@@ -106,7 +107,7 @@ static const char *upvalname (Proto *p, int uv) {
 
 static const char *findvararg (CallInfo *ci, int n, StkId *pos) {
   int nparams = clLvalue(ci->func)->p->numparams;
-  if (n >= ci->u.l.base - ci->func - nparams)
+  if (n > nvarargs(ci, nparams))
     return NULL;  /* no such vararg */
   else {
     *pos = ci->func + nparams + n;
@@ -578,3 +579,232 @@ l_noret luaG_runerror (lua_State *L, const char *fmt, ...) {
   luaG_errormsg(L);
 }
 
+
+/*
+** {======================================================
+** Allocation profiler
+** =======================================================
+*/
+
+/*
+** When enabled (see 'lua_setallocprof'), 'luaM_realloc_' reports every
+** allocation here, and one in each 'rate' bytes is sampled: the stack
+** of the running thread (source:line of each Lua frame, "[C]" for C
+** frames, at most MAXPROFFRAMES of the innermost ones) plus the kind of
+** object is charged 'rate' bytes. Samples with the same stack share an
+** entry, kept in folded format ("a.lua:3;a.lua:10;table"), ready for
+** flame-graph tools. The profile lives outside the Lua heap: it uses
+** the allocator directly and is not counted by the collector.
+*/
+
+#define MAXPROFFRAMES	32
+
+/* room for all frames, their separators and the object kind */
+#define MAXPROFKEY	(MAXPROFFRAMES * (LUA_IDSIZE + 16) + 32)
+
+
+typedef struct ProfEntry {
+  struct ProfEntry *next;  /* next entry in the same bucket */
+  struct ProfEntry *nextall;  /* entry created before this one */
+  lu_mem bytes;
+  unsigned int h;
+  size_t len;
+  char key[1];  /* folded stack ('len' bytes, not zero terminated) */
+} ProfEntry;
+
+
+typedef struct AllocProf {
+  l_mem countdown;  /* bytes to be allocated until next sample */
+  int rate;  /* average number of bytes between samples */
+  int size;  /* size of 'hash' */
+  int nentries;
+  ProfEntry **hash;
+  ProfEntry *all;  /* list of all entries, newest first */
+} AllocProf;
+
+
+static void *profalloc (global_State *g, void *block, size_t osize,
+                                                      size_t nsize) {
+  return (*g->frealloc)(g->ud, block, osize, nsize);
+}
+
+
+static size_t addframe (char *key, size_t len, CallInfo *ci) {
+  if (len > 0) key[len++] = ';';
+  if (!isLua(ci)) {
+    strcpy(key + len, "[C]");
+    return len + 3;
+  }
+  else {
+    Proto *p = ci_func(ci)->p;
+    if (p->source)
+      luaO_chunkid(key + len, getstr(p->source), LUA_IDSIZE);
+    else
+      strcpy(key + len, "?");
+    len += strlen(key + len);
+    return len + sprintf(key + len, ":%d", currentline(ci));
+  }
+}
+
+
+static unsigned int hashkey (const char *key, size_t len) {
+  unsigned int h = cast(unsigned int, len);
+  size_t i;
+  for (i = 0; i < len; i++)
+    h = h ^ ((h<<5) + (h>>2) + cast(unsigned char, key[i]));
+  return h;
+}
+
+
+static int growprof (global_State *g, AllocProf *ap) {
+  int size = (ap->size == 0) ? 64 : 2 * ap->size;
+  ProfEntry **hash = cast(ProfEntry **,
+                          profalloc(g, NULL, 0, size * sizeof(ProfEntry *)));
+  ProfEntry *e;
+  int i;
+  if (hash == NULL) return 0;
+  for (i = 0; i < size; i++) hash[i] = NULL;
+  for (e = ap->all; e != NULL; e = e->nextall) {  /* re-insert entries */
+    e->next = hash[lmod(e->h, size)];
+    hash[lmod(e->h, size)] = e;
+  }
+  if (ap->hash != NULL)
+    profalloc(g, ap->hash, ap->size * sizeof(ProfEntry *), 0);
+  ap->hash = hash;
+  ap->size = size;
+  return 1;
+}
+
+
+static void addsample (global_State *g, AllocProf *ap, const char *key,
+                                        size_t len, lu_mem bytes) {
+  unsigned int h = hashkey(key, len);
+  ProfEntry *e;
+  if (ap->size > 0) {
+    for (e = ap->hash[lmod(h, ap->size)]; e != NULL; e = e->next) {
+      if (e->h == h && e->len == len && memcmp(e->key, key, len) == 0) {
+        e->bytes += bytes;
+        return;
+      }
+    }
+  }
+  if (ap->nentries >= ap->size && !growprof(g, ap))
+    return;  /* no memory; drop sample */
+  e = cast(ProfEntry *, profalloc(g, NULL, 0, sizeof(ProfEntry) + len));
+  if (e == NULL) return;  /* no memory; drop sample */
+  memcpy(e->key, key, len);
+  e->len = len;
+  e->h = h;
+  e->bytes = bytes;
+  e->next = ap->hash[lmod(h, ap->size)];
+  ap->hash[lmod(h, ap->size)] = e;
+  e->nextall = ap->all;
+  ap->all = e;
+  ap->nentries++;
+}
+
+
+void luaG_allocsample (lua_State *L, int tt, size_t size) {
+  global_State *g = G(L);
+  AllocProf *ap = g->allocprof;
+  CallInfo *frames[MAXPROFFRAMES];
+  char key[MAXPROFKEY];
+  size_t len = 0;
+  lu_mem n;
+  int nf = 0;
+  CallInfo *ci;
+  ap->countdown -= cast(l_mem, size);
+  if (ap->countdown > 0) return;  /* not sampled */
+  n = 1 + cast(lu_mem, -ap->countdown) / ap->rate;  /* samples it covers */
+  ap->countdown += cast(l_mem, n * ap->rate);
+  for (ci = L->ci; ci != &L->base_ci && nf < MAXPROFFRAMES; ci = ci->previous)
+    frames[nf++] = ci;
+  if (ci != &L->base_ci) {  /* stack too deep? */
+    strcpy(key, "...");
+    len = 3;
+  }
+  while (nf > 0)  /* outermost frame first */
+    len = addframe(key, len, frames[--nf]);
+  if (len > 0) key[len++] = ';';
+  /* 'osize' of a new object is its type; other blocks are vectors */
+  strcpy(key + len, (tt == LUA_TNIL) ? "vector" : ttypename(tt));
+  len += strlen(key + len);
+  addsample(g, ap, key, len, n * ap->rate);
+}
+
+
+void luaG_freeallocprof (global_State *g) {
+  AllocProf *ap = g->allocprof;
+  if (ap == NULL) return;
+  g->allocprof = NULL;
+  while (ap->all != NULL) {
+    ProfEntry *e = ap->all;
+    ap->all = e->nextall;
+    profalloc(g, e, sizeof(ProfEntry) + e->len, 0);
+  }
+  if (ap->hash != NULL)
+    profalloc(g, ap->hash, ap->size * sizeof(ProfEntry *), 0);
+  profalloc(g, ap, sizeof(AllocProf), 0);
+}
+
+
+/*
+** Sample one in each 'rate' bytes allocated ('rate' = 1 records every
+** allocation with its size). A rate of 0 stops profiling and discards
+** the profile; changing the rate keeps what was collected. Returns the
+** previous rate, or -1 if there is no memory to start a profile.
+*/
+LUA_API int lua_setallocprof (lua_State *L, int rate) {
+  global_State *g;
+  AllocProf *ap;
+  int old;
+  lua_lock(L);
+  g = G(L);
+  ap = g->allocprof;
+  old = (ap != NULL) ? ap->rate : 0;
+  if (rate <= 0)
+    luaG_freeallocprof(g);
+  else if (ap == NULL) {
+    ap = cast(AllocProf *, profalloc(g, NULL, 0, sizeof(AllocProf)));
+    if (ap == NULL)
+      old = -1;
+    else {
+      ap->rate = rate;
+      ap->countdown = rate;
+      ap->size = ap->nentries = 0;
+      ap->hash = NULL;
+      ap->all = NULL;
+      g->allocprof = ap;
+    }
+  }
+  else {
+    ap->rate = rate;
+    if (ap->countdown > rate) ap->countdown = rate;
+  }
+  lua_unlock(L);
+  return old;
+}
+
+
+/*
+** Write the profile, one "stack bytes" line per entry, through 'writer'
+** (as 'lua_dump'). Entries created while writing (the writer itself
+** may allocate) are not written.
+*/
+LUA_API int lua_dumpallocprof (lua_State *L, lua_Writer writer, void *data) {
+  ProfEntry *e;
+  int status = 0;
+  lua_lock(L);
+  e = (G(L)->allocprof != NULL) ? G(L)->allocprof->all : NULL;
+  for (; e != NULL && status == 0; e = e->nextall) {
+    char buff[LUAI_MAXNUMBER2STR + 4];
+    int l = sprintf(buff, " " LUA_NUMBER_FMT "\n", cast_num(e->bytes));
+    status = (*writer)(L, e->key, e->len, data);
+    if (status == 0)
+      status = (*writer)(L, buff, l, data);
+  }
+  lua_unlock(L);
+  return status;
+}
+
+/* }====================================================== */
@@ -45,6 +45,11 @@
 ** default, Lua handles errors with exceptions when compiling as
 ** C++ code, with _longjmp/_setjmp when asked to use them, and with
 ** longjmp/setjmp otherwise.
+** C++ exceptions are table driven: entering a protected call costs
+** nothing (no register save as with setjmp), only a throw pays, and
+** destructors of C++ frames between the error and its handler run.
+** C code called from such a build must be compiled with -fexceptions
+** so that errors can unwind through it.
 */
 #if !defined(LUAI_THROW)
 
@@ -183,6 +188,150 @@ static void correctstack (lua_State *L, TValue *oldstack) {
 #define ERRORSTACKSIZE	(LUAI_MAXSTACK + 200)
 
 
+/*
+** {======================================================
+** Mapped stacks
+** =======================================================
+*/
+
+#if defined(LUA_USE_MMAPSTACK)	/* { */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+** A stack that grows to LUAI_MAPSTACKMIN slots is moved (once) to its
+** own mapping, large enough for the biggest stack allowed; the system
+** commits its pages as they are touched, so from then on the stack
+** grows in place, without copying it or correcting pointers into it.
+** When such a stack shrinks its pages are kept, ready to grow again,
+** and the mappings of dead threads are kept (up to MAPSTACKCACHE) for
+** new big stacks. The collector is charged for all those pages: a
+** mapped stack (or a kept mapping) is charged for the peak size it had
+** ('stackcharged'). Emergency collections give back the pages above
+** each stack and unmap the kept mappings. Arenas keep their stacks in
+** the heap, as they do not free threads one by one.
+*/
+#if !defined(LUAI_MAPSTACKMIN)
+#define LUAI_MAPSTACKMIN	8192
+#endif
+
+#define MAPSTACKCACHE	4
+
+#define MAPSTACKBYTES	(ERRORSTACKSIZE * sizeof(TValue))
+
+/* free mappings are linked through their first slot */
+#define nextmap(s)	(*cast(TValue **, (s)))
+
+/* slots still charged for a free mapping, kept in its second slot */
+#define mapcharged(s)	(*cast(int *, (s) + 1))
+
+
+/*
+** try to move the stack of 'L' to a mapping with room for 'newsize'
+** slots; returns 0 (leaving the stack alone) if it cannot
+*/
+static int movetomap (lua_State *L, int newsize) {
+  global_State *g = G(L);
+  TValue *stack;
+  int charged;
+  if (newsize < LUAI_MAPSTACKMIN || g->arena)
+    return 0;
+  if (g->stackcache != NULL) {  /* reuse a free mapping */
+    stack = g->stackcache;
+    charged = mapcharged(stack);  /* its pages are already charged */
+    if (charged < newsize) {
+      luaM_charge(L, charged * sizeof(TValue), newsize * sizeof(TValue));
+      charged = newsize;  /* (charge may raise an error; stack still valid) */
+    }
+    g->stackcache = nextmap(stack);
+    g->nstackcache--;
+  }
+  else {
+    void *p;
+    luaM_charge(L, 0, newsize * sizeof(TValue));  /* may raise an error */
+    p = mmap(NULL, MAPSTACKBYTES, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+      luaM_charge(L, newsize * sizeof(TValue), 0);
+      return 0;
+    }
+    stack = cast(TValue *, p);
+    charged = newsize;
+  }
+  memcpy(stack, L->stack, L->stacksize * sizeof(TValue));
+  luaM_freearray(L, L->stack, L->stacksize);
+  L->stack = stack;
+  L->stackcharged = charged;
+  L->stackmapped = 1;
+  return 1;
+}
+
+#endif				/* } */
+
+
+void luaD_freestack (lua_State *L) {
+#if defined(LUA_USE_MMAPSTACK)
+  if (L->stackmapped) {
+    global_State *g = G(L);
+    if (g->nstackcache < MAPSTACKCACHE) {  /* keep mapping for reuse */
+      nextmap(L->stack) = g->stackcache;  /* (its pages stay charged) */
+      mapcharged(L->stack) = L->stackcharged;
+      g->stackcache = L->stack;
+      g->nstackcache++;
+    }
+    else {
+      luaM_charge(L, L->stackcharged * sizeof(TValue), 0);
+      munmap(L->stack, MAPSTACKBYTES);
+    }
+    return;
+  }
+#endif
+  luaM_freearray(L, L->stack, L->stacksize);
+}
+
+
+/*
+** give back to the system the pages of a mapped stack above its size
+*/
+void luaD_trimstack (lua_State *L) {
+#if defined(LUA_USE_MMAPSTACK)
+  if (L->stackmapped && L->stackcharged > L->stacksize) {
+    size_t mask = cast(size_t, sysconf(_SC_PAGESIZE)) - 1;
+    size_t from = (L->stacksize * sizeof(TValue) + mask) & ~mask;
+    if (from < MAPSTACKBYTES)
+      madvise(cast(char *, L->stack) + from, MAPSTACKBYTES - from,
+              MADV_DONTNEED);
+    luaM_charge(L, L->stackcharged * sizeof(TValue),
+                   L->stacksize * sizeof(TValue));
+    L->stackcharged = L->stacksize;
+  }
+#else
+  UNUSED(L);
+#endif
+}
+
+
+/*
+** unmap all free stack mappings
+*/
+void luaD_freestackcache (global_State *g) {
+#if defined(LUA_USE_MMAPSTACK)
+  while (g->stackcache != NULL) {
+    TValue *stack = g->stackcache;
+    g->stackcache = nextmap(stack);
+    g->GCdebt -= mapcharged(stack) * sizeof(TValue);  /* uncharge it */
+    munmap(stack, MAPSTACKBYTES);
+  }
+  g->nstackcache = 0;
+#else
+  UNUSED(g);
+#endif
+}
+
+/* }====================================================== */
+
+
 // 重新分配栈空间
 // FIXME: newsize == ERRORSTACKSIZE时,会怎么处理?
 // 随后会有luaG_runerror的调用
@@ -191,6 +340,16 @@ void luaD_reallocstack (lua_State *L, int newsize) {
   int lim = L->stacksize;
   lua_assert(newsize <= LUAI_MAXSTACK || newsize == ERRORSTACKSIZE);
   lua_assert(L->stack_last - L->stack == L->stacksize - EXTRA_STACK);
+#if defined(LUA_USE_MMAPSTACK)
+  if (L->stackmapped) {  /* resize in place */
+    if (newsize > L->stackcharged) {  /* touching new pages? */
+      luaM_charge(L, L->stackcharged * sizeof(TValue),
+                     newsize * sizeof(TValue));
+      L->stackcharged = newsize;
+    }
+  }
+  else if (!movetomap(L, newsize))
+#endif
   luaM_reallocvector(L, L->stack, L->stacksize, newsize, TValue);
 
   // 初值清零
@@ -201,7 +360,8 @@ void luaD_reallocstack (lua_State *L, int newsize) {
 
   // 调整top/upv/ci
   // 后两者都是指针
-  correctstack(L, oldstack);
+  if (L->stack != oldstack)
+    correctstack(L, oldstack);
 }
 
 
@@ -316,6 +476,8 @@ static StkId adjust_varargs (lua_State *L, Proto *p, int actual) {
   int nfixargs = p->numparams;
   StkId base, fixed;
   lua_assert(actual >= nfixargs);
+  if (actual == nfixargs)  /* no extra arguments? */
+    return L->top - actual;  /* keep fixed parameters in place */
   /* move fixed parameters to final position */
   fixed = L->top - actual;  /* first fixed argument */
   base = L->top;  /* final position of first argument */
@@ -347,10 +509,6 @@ static StkId tryfuncTM (lua_State *L, StkId func) {
 }
 
 
-
-#define next_ci(L) (L->ci = (L->ci->next ? L->ci->next : luaE_extendCI(L)))
-
-
 /*
 ** returns true if function has been executed (C function)
 */
@@ -369,7 +527,7 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
   switch (ttype(func)) {
     // C函数直接调用
     // 不涉及vm
-    case LUA_TLCF:  /* light C function */
+    case LUA_TLCF: case LUA_TLLF:  /* light C function */
       f = fvalue(func);
       goto Cfunc;
     case LUA_TCCL: {  /* C closure */
@@ -396,6 +554,8 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
 	  // C调用,f,参数和L->top,ci->top
       n = (*f)(L);  /* do the actual call */
       lua_lock(L);
+      if (L->status == LUA_YIELD)  /* yielded without a long jump? */
+        return 1;  /* leave it to 'resume' to finish the call */
       api_checknelems(L, n);
       luaD_poscall(L, L->top - n);
       return 1;
@@ -521,6 +681,8 @@ static void finishCcall (lua_State *L) {
   // k是xx_callk系列提供的continue函数,用于C在yield+resume后执行的
   n = (*ci->u.c.k)(L);
   lua_lock(L);
+  if (L->status == LUA_YIELD)  /* continuation yielded without a long jump? */
+    return;  /* frame is suspended again; 'unroll' stops */
   api_checknelems(L, n);
   /* finish 'luaD_precall' */
   luaD_poscall(L, L->top - n);
@@ -536,6 +698,8 @@ static void unroll (lua_State *L, void *ud) {
   for (;;) {
     if (L->ci == &L->base_ci)  /* stack is empty? */
       return;  /* coroutine finished normally */
+    if (L->status == LUA_YIELD)  /* yielded without a long jump? */
+      return;
     if (!isLua(L->ci))  /* C function? */
       finishCcall(L);
     else {  /* Lua function */
@@ -638,6 +802,8 @@ static void resume (lua_State *L, void *ud) {
         lua_unlock(L);
         n = (*ci->u.c.k)(L);  /* call continuation */
         lua_lock(L);
+        if (L->status == LUA_YIELD)  /* yielded again, without a long jump? */
+          return;  /* 'lua_resume' returns LUA_YIELD */
         api_checknelems(L, n);
         firstArg = L->top - n;  /* yield results come from continuation */
       }
@@ -657,6 +823,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
   lua_lock(L);
   luai_userstateresume(L, nargs);
   L->nCcalls = (from) ? from->nCcalls + 1 : 1;
+  L->baseCcalls = L->nCcalls;
   // 给luaD_call的累加提供初始值
   // 也就是说,这里不是清零,而是初始而已,所有的coroutine都需要resume才能运行
   L->nny = 0;  /* allow yields */
@@ -679,6 +846,8 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs) {
         break;
       }
     }
+    if (status == LUA_OK)
+      status = L->status;  /* LUA_YIELD if it yielded without a long jump */
     lua_assert(status == L->status);
   }
   L->nny = 1;  /* do not allow yields */
@@ -714,6 +883,11 @@ LUA_API int lua_yieldk (lua_State *L, int nresults, int ctx, lua_CFunction k) {
     if ((ci->u.c.k = k) != NULL)  /* is there a continuation? */
       ci->u.c.ctx = ctx;  /* save context */
     ci->func = L->top - nresults - 1;  /* protect stack below results */
+    /* no C level between this call and 'resume'? (not even a hook) */
+    if (L->nCcalls == L->baseCcalls && !(ci->callstatus & CIST_HOOKED)) {
+      lua_unlock(L);
+      return 0;  /* return through 'luaD_precall' and 'luaV_execute' */
+    }
     // TODO: 这个throw去了哪里?
     // 应该是lua_resume的status = luaD_rawrunprotected(L, resume, L->top - nargs);
     // yield是在resume中返回
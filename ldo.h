@@ -19,6 +19,8 @@
 
 #define incr_top(L) {L->top++; luaD_checkstack(L,0);}
 
+#define next_ci(L) (L->ci = (L->ci->next ? L->ci->next : luaE_extendCI(L)))
+
 // 应该是很多时候无法直接传递指针,所以就传递与一个固定值的偏移L->stack
 // 计算偏移
 #define savestack(L,p)		((char *)(p) - (char *)L->stack)
@@ -41,6 +43,9 @@ LUAI_FUNC int luaD_poscall (lua_State *L, StkId firstResult);
 LUAI_FUNC void luaD_reallocstack (lua_State *L, int newsize);
 LUAI_FUNC void luaD_growstack (lua_State *L, int n);
 LUAI_FUNC void luaD_shrinkstack (lua_State *L);
+LUAI_FUNC void luaD_freestack (lua_State *L);
+LUAI_FUNC void luaD_trimstack (lua_State *L);
+LUAI_FUNC void luaD_freestackcache (global_State *g);
 
 LUAI_FUNC l_noret luaD_throw (lua_State *L, int errcode);
 LUAI_FUNC int luaD_rawrunprotected (lua_State *L, Pfunc f, void *ud);
@@ -5,12 +5,17 @@
 */
 
 #include <string.h>
+#include <time.h>
 
 #define lgc_c
 #define LUA_CORE
 
 #include "lua.h"
 
+#if defined(LUA_USE_PTHREADS)
+#include <pthread.h>
+#endif
+
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -50,6 +55,28 @@
 #define PAUSEADJ		200
 
 
+/*
+** a clock in microseconds, used by time-based pacing (only the
+** difference between two readings matters)
+*/
+#if !defined(luai_gcclock)
+
+#if defined(LUA_USE_POSIX)
+static lu_mem gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(lu_mem, ts.tv_sec) * 1000000 + cast(lu_mem, ts.tv_nsec / 1000);
+}
+#else
+static lu_mem gcclock (void) {
+  return cast(lu_mem, cast(double, clock()) * 1000000 / CLOCKS_PER_SEC);
+}
+#endif
+
+#define luai_gcclock()	gcclock()
+#endif
+
+
 
 
 /*
@@ -88,6 +115,12 @@
 		reallymarkobject(g, obj2gco(t)); }
 
 static void reallymarkobject (global_State *g, GCObject *o);
+static void releasepending (global_State *g, GCObject *k);
+
+#if defined(LUA_USE_PTHREADS)
+static int claimobject (GCObject *o);
+static void markparallel (global_State *g);
+#endif
 
 
 /*
@@ -221,11 +254,20 @@ void luaC_checkupvalcolor (global_State *g, UpVal *uv) {
 // list == NULL: 뵽ȫgclist(G(L)->allgc)
 GCObject *luaC_newobj (lua_State *L, int tt, size_t sz, GCObject **list,
                        int offset) {
-  global_State *g = G(L);
   char *raw = cast(char *, luaM_newobject(L, novariant(tt), sz));
-  GCObject *o = obj2gco(raw + offset);
+  return luaC_linkobj(G(L), obj2gco(raw + offset), tt, list);
+}
+
+
+/*
+** link an already allocated object 'o' (new or reused) as a new
+** object in 'list'
+*/
+GCObject *luaC_linkobj (global_State *g, GCObject *o, int tt,
+                        GCObject **list) {
   if (list == NULL)
     list = &g->allgc;  /* standard list for collectable objects */
+  g->gcstats.objects[novariant(tt)]++;
   // clean
   gch(o)->marked = luaC_white(g);
   gch(o)->tt = tt;
@@ -255,7 +297,16 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz, GCObject **list,
 */
 static void reallymarkobject (global_State *g, GCObject *o) {
   lu_mem size;
+#if defined(LUA_USE_PTHREADS)
+  if (g->markers != NULL) {  /* marking in parallel? */
+    if (!claimobject(o))  /* another marker got it first? */
+      return;
+  }
+  else
+#endif
   white2gray(o);
+  if (g->ephpending != NULL)  /* converging ephemerons? */
+    releasepending(g, o);  /* values waiting for this key may go now */
   switch (gch(o)->tt) {
     case LUA_TSHRSTR:
     case LUA_TLNGSTR: {
@@ -388,6 +439,150 @@ static void traverseweakvalue (global_State *g, Table *h) {
 }
 
 
+/*
+** {======================================================
+** Pending ephemeron entries
+** =======================================================
+*/
+
+/*
+** While 'convergeephemerons' runs, each entry "white key -> white
+** value" found in an ephemeron table is recorded under its key. When
+** the key is marked, 'reallymarkobject' moves the values waiting for
+** it to the 'released' list, to be marked by the converging loop.
+** Each entry is so visited a constant number of times, instead of
+** once per pass over all ephemeron tables. The memory used here is
+** taken directly from the allocator (errors are not allowed inside
+** the atomic phase); if it fails, the collector falls back to
+** traversing all ephemeron tables until nothing changes.
+*/
+
+typedef struct EphKey {
+  GCObject *k;  /* key (NULL if slot is free) */
+  int head;  /* first pending value for this key (-1 if none) */
+} EphKey;
+
+typedef struct EphValue {
+  GCObject *v;
+  int next;  /* next value in the same list (-1 if none) */
+} EphValue;
+
+typedef struct EphPending {
+  EphKey *keys;  /* open-addressing hash of keys */
+  EphValue *values;
+  int sizekeys;  /* always a power of 2 */
+  int nkeys;
+  int sizevalues;
+  int nvalues;
+  int released;  /* list of values whose keys have been marked */
+  int failed;  /* true if some entry could not be recorded */
+} EphPending;
+
+
+#define MINPENDING	64
+
+#define keyslot(ep,k)	(IntPoint(k) % (((ep)->sizekeys - 1) | 1))
+
+
+static void *pendingalloc (global_State *g, void *block, size_t osize,
+                                                         size_t nsize) {
+  return (*g->frealloc)(g->ud, block, osize, nsize);
+}
+
+
+static EphKey *findkey (EphPending *ep, GCObject *k) {
+  int i = keyslot(ep, k);
+  while (ep->keys[i].k != k && ep->keys[i].k != NULL)
+    i = (i + 1) & (ep->sizekeys - 1);  /* linear probing */
+  return &ep->keys[i];
+}
+
+
+static int growkeys (global_State *g, EphPending *ep) {
+  EphKey *old = ep->keys;
+  int oldsize = ep->sizekeys;
+  int size = (oldsize == 0) ? MINPENDING : 2 * oldsize;
+  int i;
+  EphKey *keys = cast(EphKey *,
+                      pendingalloc(g, NULL, 0, size * sizeof(EphKey)));
+  if (keys == NULL) return 0;
+  for (i = 0; i < size; i++) keys[i].k = NULL;
+  ep->keys = keys;
+  ep->sizekeys = size;
+  for (i = 0; i < oldsize; i++) {  /* re-insert old keys */
+    if (old[i].k != NULL)
+      *findkey(ep, old[i].k) = old[i];
+  }
+  if (old != NULL) pendingalloc(g, old, oldsize * sizeof(EphKey), 0);
+  return 1;
+}
+
+
+static int growvalues (global_State *g, EphPending *ep) {
+  int size = (ep->sizevalues == 0) ? MINPENDING : 2 * ep->sizevalues;
+  EphValue *values = cast(EphValue *,
+      pendingalloc(g, ep->values, ep->sizevalues * sizeof(EphValue),
+                                  size * sizeof(EphValue)));
+  if (values == NULL) return 0;
+  ep->values = values;
+  ep->sizevalues = size;
+  return 1;
+}
+
+
+/*
+** record that value 'v' must be marked when key 'k' is
+*/
+static void addpending (global_State *g, GCObject *k, GCObject *v) {
+  EphPending *ep = g->ephpending;
+  EphKey *slot;
+  if (ep->failed)
+    return;
+  if (((ep->nkeys + 1) * 4 > ep->sizekeys * 3 && !growkeys(g, ep)) ||
+      (ep->nvalues == ep->sizevalues && !growvalues(g, ep))) {
+    ep->failed = 1;  /* entries must be found by re-traversals */
+    return;
+  }
+  slot = findkey(ep, k);
+  if (slot->k == NULL) {  /* new key? */
+    slot->k = k;
+    slot->head = -1;
+    ep->nkeys++;
+  }
+  ep->values[ep->nvalues].v = v;
+  ep->values[ep->nvalues].next = slot->head;
+  slot->head = ep->nvalues++;
+}
+
+
+/*
+** key 'k' has just been marked: move its pending values to the
+** 'released' list
+*/
+static void releasepending (global_State *g, GCObject *k) {
+  EphPending *ep = g->ephpending;
+  EphKey *slot;
+  int i;
+  if (ep->nkeys == 0) return;
+  slot = findkey(ep, k);
+  if (slot->k == NULL || slot->head == -1) return;
+  for (i = slot->head; ep->values[i].next != -1; i = ep->values[i].next) ;
+  ep->values[i].next = ep->released;  /* append released list to the chain */
+  ep->released = slot->head;
+  slot->head = -1;
+}
+
+
+static void freepending (global_State *g, EphPending *ep) {
+  if (ep->keys != NULL)
+    pendingalloc(g, ep->keys, ep->sizekeys * sizeof(EphKey), 0);
+  if (ep->values != NULL)
+    pendingalloc(g, ep->values, ep->sizevalues * sizeof(EphValue), 0);
+}
+
+/* }====================================================== */
+
+
 static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
   int hasclears = 0;  /* true if table has white keys */
@@ -408,8 +603,11 @@ static int traverseephemeron (global_State *g, Table *h) {
       removeentry(n);  /* remove it */
     else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
       hasclears = 1;  /* table must be cleared */
-      if (valiswhite(gval(n)))  /* value not marked yet? */
+      if (valiswhite(gval(n))) {  /* value not marked yet? */
         prop = 1;  /* must propagate again */
+        if (g->ephpending != NULL)  /* converging? */
+          addpending(g, gcvalue(gkey(n)), gcvalue(gval(n)));
+      }
     }
     else if (valiswhite(gval(n))) {  /* value not marked yet? */
       marked = 1;
@@ -446,7 +644,9 @@ static void traversestrongtable (global_State *g, Table *h) {
 
 static lu_mem traversetable (global_State *g, Table *h) {
   const char *weakkey, *weakvalue;
-  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  const TValue *mode = (g->markers == NULL)
+                     ? gfasttm(g, h->metatable, TM_MODE)
+                     : gfasttmro(g, h->metatable, TM_MODE);  /* shared */
   markobject(g, h->metatable);
   if (mode && ttisstring(mode) &&  /* is there a weak mode? */
       ((weakkey = strchr(svalue(mode), 'k')),
@@ -569,8 +769,30 @@ static void propagatemark (global_State *g) {
 }
 
 
+/*
+** number of objects traversed by 'propagateall' before handing the
+** rest of the gray list to parallel markers; small lists (the common
+** case for the atomic phase of an incremental collection) are never
+** worth starting threads
+*/
+#if !defined(LUAI_PARMARKSTEP)
+#define LUAI_PARMARKSTEP	4096
+#endif
+
+
 static void propagateall (global_State *g) {
+#if defined(LUA_USE_PTHREADS)
+  int n = 0;
+  while (g->gray) {
+    propagatemark(g);
+    if (++n == LUAI_PARMARKSTEP && g->gcmarkers > 1 && g->gray) {
+      markparallel(g);
+      return;
+    }
+  }
+#else
   while (g->gray) propagatemark(g);
+#endif
 }
 
 
@@ -597,7 +819,31 @@ static void retraversegrays (global_State *g) {
 }
 
 
-static void convergeephemerons (global_State *g) {
+/*
+** mark everything reachable from gray objects and from values whose
+** keys have been marked
+*/
+static void propagatepending (global_State *g) {
+  EphPending *ep = g->ephpending;
+  for (;;) {
+    if (g->gray)
+      propagatemark(g);
+    else if (ep->released != -1) {
+      EphValue *p = &ep->values[ep->released];
+      ep->released = p->next;
+      if (iswhite(p->v))  /* not marked through another path? */
+        reallymarkobject(g, p->v);
+    }
+    else break;
+  }
+}
+
+
+/*
+** traverse all ephemeron tables until nothing changes; used when there
+** is no memory to record pending entries
+*/
+static void retraverseephemerons (global_State *g) {
   int changed;
   do {
     GCObject *w;
@@ -614,7 +860,238 @@ static void convergeephemerons (global_State *g) {
   } while (changed);
 }
 
+
+static void convergeephemerons (global_State *g) {
+  EphPending ep;
+  GCObject *w;
+  GCObject *next = g->ephemeron;  /* get ephemeron list */
+  if (next == NULL) return;  /* nothing to converge */
+  ep.keys = NULL; ep.values = NULL;
+  ep.sizekeys = ep.nkeys = ep.sizevalues = ep.nvalues = 0;
+  ep.released = -1;
+  ep.failed = 0;
+  g->ephpending = &ep;
+  g->ephemeron = NULL;  /* tables will return to this list when traversed */
+  while ((w = next) != NULL) {
+    next = gco2t(w)->gclist;
+    traverseephemeron(g, gco2t(w));
+    propagatepending(g);  /* new ephemeron tables are recorded on the way */
+  }
+  g->ephpending = NULL;
+  freepending(g, &ep);
+  if (ep.failed)  /* some entry was not recorded? */
+    retraverseephemerons(g);
+}
+
+/* }====================================================== */
+
+
+#if defined(LUA_USE_PTHREADS)
+/*
+** {======================================================
+** Parallel marking
+** =======================================================
+*/
+
+/*
+** Each marker works on its own copy of the global state, so that
+** the traverse functions above, unchanged, link gray objects and
+** weak tables into lists private to that marker. An object belongs
+** to the marker that turns it from white to gray ('claimobject');
+** only that marker writes to it. When some marker runs out of work,
+** busy markers cut their gray lists and hand the tails to the idle
+** ones through a small shared pool. When all markers are idle and
+** the pool is empty, marking is over and the private lists are
+** moved back into the real global state.
+*/
+
+/* maximum number of gray lists waiting in the shared pool */
+#define MARKPOOLSIZE	(2 * LUAI_MAXMARKERS)
+
+/* a marker keeps (at most) that many objects when sharing its list */
+#define MARKKEEP	32
+
+
+typedef struct Markers {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int n;  /* number of markers */
+  volatile int nidle;  /* number of markers waiting for work */
+  int npool;  /* number of lists in 'pool' */
+  GCObject *pool[MARKPOOLSIZE];  /* gray lists waiting for a marker */
+} Markers;
+
+
+/*
+** atomically turn a white object gray; returns 0 if the object was
+** not white anymore (it was claimed by another marker)
+*/
+static int claimobject (GCObject *o) {
+  lu_byte old;
+  do {
+    old = gch(o)->marked;
+    if (!testbits(old, WHITEBITS))
+      return 0;
+  } while (!__sync_bool_compare_and_swap(&gch(o)->marked, old,
+                                         cast_byte(old & ~WHITEBITS)));
+  return 1;
+}
+
+
+static GCObject **getgclist (GCObject *o) {
+  switch (gch(o)->tt) {
+    case LUA_TTABLE: return &gco2t(o)->gclist;
+    case LUA_TLCL: return &gco2lcl(o)->gclist;
+    case LUA_TCCL: return &gco2ccl(o)->gclist;
+    case LUA_TTHREAD: return &gco2th(o)->gclist;
+    case LUA_TPROTO: return &gco2p(o)->gclist;
+    default: lua_assert(0); return NULL;
+  }
+}
+
+
+/*
+** give part of the gray list of 'g' to idle markers: keep its first
+** half, up to MARKKEEP objects, and put the rest in the pool
+*/
+static void sharegray (global_State *g) {
+  Markers *m = g->markers;
+  GCObject *slow = g->gray;
+  GCObject *fast = *getgclist(slow);
+  int i;
+  for (i = 1; i < MARKKEEP && fast != NULL; i++) {
+    fast = *getgclist(fast);
+    if (fast == NULL) break;
+    fast = *getgclist(fast);
+    slow = *getgclist(slow);
+  }
+  if (*getgclist(slow) == NULL)
+    return;  /* single object; nothing to share */
+  pthread_mutex_lock(&m->lock);
+  if (m->npool < MARKPOOLSIZE) {
+    GCObject **tail = getgclist(slow);
+    m->pool[m->npool++] = *tail;
+    *tail = NULL;
+    pthread_cond_signal(&m->cond);
+  }
+  pthread_mutex_unlock(&m->lock);
+}
+
+
+/*
+** wait for a list from the pool; returns 0 when all markers are out
+** of work
+*/
+static int getgray (global_State *g) {
+  Markers *m = g->markers;
+  int res = 0;
+  pthread_mutex_lock(&m->lock);
+  m->nidle++;
+  while (m->npool == 0 && m->nidle < m->n)
+    pthread_cond_wait(&m->cond, &m->lock);
+  if (m->npool > 0) {
+    g->gray = m->pool[--m->npool];
+    m->nidle--;
+    res = 1;
+  }
+  else  /* everybody is idle: marking is over */
+    pthread_cond_broadcast(&m->cond);
+  pthread_mutex_unlock(&m->lock);
+  return res;
+}
+
+
+static void *marker (void *ud) {
+  global_State *g = cast(global_State *, ud);
+  do {
+    while (g->gray) {
+      propagatemark(g);
+      if (g->markers->nidle > 0 && g->gray)
+        sharegray(g);
+    }
+  } while (getgray(g));
+  return NULL;
+}
+
+
+/*
+** append list 'l' (linked by 'gclist') to list '*p'
+*/
+static void appendlist (GCObject **p, GCObject *l) {
+  while (*p != NULL)
+    p = getgclist(*p);
+  *p = l;
+}
+
+
+/*
+** mark everything reachable from the gray list of 'g' using
+** 'g->gcmarkers' threads (including the running one)
+*/
+static void markparallel (global_State *g) {
+  Markers m;
+  global_State *wg = g->markerstates;  /* states for the extra markers */
+  pthread_t th[LUAI_MAXMARKERS - 1];
+  int nth = 0;
+  int i;
+  pthread_mutex_init(&m.lock, NULL);
+  pthread_cond_init(&m.cond, NULL);
+  m.n = g->gcmarkers;
+  m.nidle = 0;
+  m.npool = 0;
+  g->markers = &m;
+  for (i = 0; i < g->gcmarkers - 1; i++) {
+    global_State *w = &wg[nth];
+    *w = *g;
+    w->gray = w->grayagain = NULL;
+    w->weak = w->ephemeron = w->allweak = NULL;
+    w->GCmemtrav = 0;
+    if (pthread_create(&th[nth], NULL, marker, w) == 0)
+      nth++;
+    else {  /* cannot create thread; go on with fewer markers */
+      pthread_mutex_lock(&m.lock);
+      m.n--;
+      pthread_cond_broadcast(&m.cond);
+      pthread_mutex_unlock(&m.lock);
+    }
+  }
+  marker(g);  /* running thread is a marker too */
+  for (i = 0; i < nth; i++) {
+    global_State *w = &wg[i];
+    pthread_join(th[i], NULL);
+    lua_assert(w->gray == NULL);
+    appendlist(&w->grayagain, g->grayagain);
+    g->grayagain = w->grayagain;
+    appendlist(&w->weak, g->weak);
+    g->weak = w->weak;
+    appendlist(&w->ephemeron, g->ephemeron);
+    g->ephemeron = w->ephemeron;
+    appendlist(&w->allweak, g->allweak);
+    g->allweak = w->allweak;
+    g->GCmemtrav += w->GCmemtrav;
+  }
+  g->markers = NULL;
+  pthread_cond_destroy(&m.cond);
+  pthread_mutex_destroy(&m.lock);
+}
+
 /* }====================================================== */
+#endif
+
+
+/*
+** set the number of threads marking objects ('n' in range) and return
+** the old number. The states used by the extra markers are allocated
+** here, so that starting them never needs memory during a collection.
+*/
+int luaC_setmarkers (lua_State *L, int n) {
+  global_State *g = G(L);
+  int old = g->gcmarkers;
+  lua_assert(1 <= n && n <= LUAI_MAXMARKERS);
+  luaM_reallocvector(L, g->markerstates, old - 1, n - 1, global_State);
+  g->gcmarkers = cast_byte(n);
+  return old;
+}
 
 
 /*
@@ -666,7 +1143,222 @@ static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
 }
 
 
+#if defined(LUA_USE_PTHREADS)
+/*
+** {======================================================
+** Background freeing
+** =======================================================
+*/
+
+/*
+** When enabled (see 'luaC_setfreer'), the sweep phase only unlinks dead
+** strings, userdata, closures, and tables; their memory blocks are
+** collected into batches that a separate thread gives back to the
+** allocator. So, the allocator function must be thread safe (as is
+** the one from 'luaL_newstate'). Other objects (and all objects
+** during an emergency collection, when memory must be released
+** right away) are freed as usual. When no batch is available, the
+** collector also frees blocks itself instead of waiting.
+*/
+
+/* number of blocks in a batch */
+#define FREEBATCH	256
+
+/* number of batches */
+#define NFREEBATCHES	8
+
+
+typedef struct FreeBatch {
+  int n;  /* number of blocks in batch */
+  struct {
+    void *block;
+    size_t size;
+  } b[FREEBATCH];
+} FreeBatch;
+
+
+typedef struct Freer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;  /* signals a new full batch (or 'stop') */
+  lua_Alloc frealloc;  /* allocator used to free blocks */
+  void *ud;
+  int stop;  /* true when thread must finish */
+  int nfull;  /* number of batches in 'full' */
+  int nempty;  /* number of batches in 'empty' */
+  FreeBatch *current;  /* batch being filled by the collector */
+  FreeBatch *full[NFREEBATCHES];  /* batches waiting to be freed */
+  FreeBatch *empty[NFREEBATCHES];  /* batches ready to be filled */
+  FreeBatch batches[NFREEBATCHES];
+} Freer;
+
+
+static void *freerthread (void *ud) {
+  Freer *f = cast(Freer *, ud);
+  pthread_mutex_lock(&f->lock);
+  for (;;) {
+    FreeBatch *fb;
+    int i;
+    while (f->nfull == 0 && !f->stop)
+      pthread_cond_wait(&f->cond, &f->lock);
+    if (f->nfull == 0) break;  /* stopped and nothing left to free */
+    fb = f->full[--f->nfull];
+    pthread_mutex_unlock(&f->lock);
+    for (i = 0; i < fb->n; i++)
+      (*f->frealloc)(f->ud, fb->b[i].block, fb->b[i].size, 0);
+    fb->n = 0;
+    pthread_mutex_lock(&f->lock);
+    f->empty[f->nempty++] = fb;
+  }
+  pthread_mutex_unlock(&f->lock);
+  return NULL;
+}
+
+
+/*
+** send current batch (if any) to the thread and get an empty one
+** (if available)
+*/
+static void nextbatch (Freer *f) {
+  pthread_mutex_lock(&f->lock);
+  if (f->current != NULL && f->current->n > 0) {
+    f->full[f->nfull++] = f->current;
+    f->current = NULL;
+    pthread_cond_signal(&f->cond);
+  }
+  if (f->current == NULL && f->nempty > 0)
+    f->current = f->empty[--f->nempty];
+  pthread_mutex_unlock(&f->lock);
+}
+
+
+static void freeblock (lua_State *L, void *block, size_t size) {
+  global_State *g = G(L);
+  Freer *f = g->freer;
+  if (block == NULL) return;
+  if (f->current == NULL || f->current->n == FREEBATCH)
+    nextbatch(f);
+  if (f->current == NULL)  /* no batch available? */
+    luaM_freemem(L, block, size);  /* do it here */
+  else {
+    FreeBatch *fb = f->current;
+    fb->b[fb->n].block = block;
+    fb->b[fb->n].size = size;
+    fb->n++;
+    g->GCdebt -= size;  /* as if it was already freed */
+  }
+}
+
+
+/*
+** give the blocks of object 'o' to the freeing thread, if it is
+** an object that can be freed that way
+*/
+static int freelater (lua_State *L, GCObject *o) {
+  switch (gch(o)->tt) {
+    case LUA_TLCL: {
+      freeblock(L, o, sizeLclosure(gco2lcl(o)->nupvalues));
+      return 1;
+    }
+    case LUA_TCCL: {
+      freeblock(L, o, sizeCclosure(gco2ccl(o)->nupvalues));
+      return 1;
+    }
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      if (!luaH_isdummy(h->node))
+        freeblock(L, h->node, sizeof(Node) * sizenode(h));
+      freeblock(L, h->array, sizeof(TValue) * h->sizearray);
+      freeblock(L, h, sizeof(Table));
+      return 1;
+    }
+    case LUA_TUSERDATA: {
+      freeblock(L, o, sizeudata(gco2u(o)));
+      return 1;
+    }
+    case LUA_TSHRSTR:
+      G(L)->strt.nuse--;
+      /* go through */
+    case LUA_TLNGSTR: {
+      freeblock(L, o, sizestring(gco2ts(o)));
+      return 1;
+    }
+    default: return 0;
+  }
+}
+
+
+static void stopfreer (lua_State *L) {
+  global_State *g = G(L);
+  Freer *f = g->freer;
+  g->freer = NULL;
+  nextbatch(f);  /* send last batch */
+  pthread_mutex_lock(&f->lock);
+  f->stop = 1;
+  pthread_cond_signal(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+  pthread_join(f->thread, NULL);  /* wait until all blocks are freed */
+  pthread_cond_destroy(&f->cond);
+  pthread_mutex_destroy(&f->lock);
+  luaM_free(L, f);
+}
+
+
+static int startfreer (lua_State *L) {
+  global_State *g = G(L);
+  Freer *f = luaM_new(L, Freer);
+  int i;
+  f->frealloc = g->frealloc;
+  f->ud = g->ud;
+  f->stop = 0;
+  f->nfull = 0;
+  f->nempty = NFREEBATCHES;
+  f->current = NULL;
+  for (i = 0; i < NFREEBATCHES; i++) {
+    f->batches[i].n = 0;
+    f->empty[i] = &f->batches[i];
+  }
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+  if (pthread_create(&f->thread, NULL, freerthread, f) != 0) {
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->lock);
+    luaM_free(L, f);
+    return 0;
+  }
+  g->freer = f;
+  return 1;
+}
+
+/* }====================================================== */
+#endif
+
+
+/*
+** turn background freeing on or off; returns whether it was on
+*/
+int luaC_setfreer (lua_State *L, int on) {
+#if defined(LUA_USE_PTHREADS)
+  int old = (G(L)->freer != NULL);
+  if (on && !old)
+    startfreer(L);
+  else if (!on && old)
+    stopfreer(L);
+  return old;
+#else
+  UNUSED(L); UNUSED(on);
+  return 0;
+#endif
+}
+
+
 static void freeobj (lua_State *L, GCObject *o) {
+  G(L)->gcstats.objects[novariant(gch(o)->tt)]--;
+#if defined(LUA_USE_PTHREADS)
+  if (G(L)->freer != NULL && G(L)->gckind != KGC_EMERGENCY &&
+      freelater(L, o))
+    return;
+#endif
   switch (gch(o)->tt) {
     case LUA_TPROTO: luaF_freeproto(L, gco2p(o)); break;
     case LUA_TLCL: {
@@ -708,6 +1400,8 @@ static void sweepthread (lua_State *L, lua_State *L1) {
   /* should not change the stack during an emergency gc cycle */
   if (G(L)->gckind != KGC_EMERGENCY)
     luaD_shrinkstack(L1);
+  else
+    luaD_trimstack(L1);  /* but may give back unused pages */
 }
 
 
@@ -977,6 +1671,10 @@ void luaC_freeallobjects (lua_State *L) {
   separatetobefnz(L, 1);  /* separate all objects with finalizers */
   lua_assert(g->finobj == NULL);
   callallpendingfinalizers(L, 0);
+  if (g->arena) {  /* allocator will free all objects at once? */
+    luaC_setfreer(L, 0);  /* stop background freeing */
+    return;
+  }
   g->currentwhite = WHITEBITS; /* this "white" makes all objects look dead */
   g->gckind = KGC_NORMAL;
   sweepwholelist(L, &g->finobj);  /* finalizers can create objs. in 'finobj' */
@@ -984,6 +1682,7 @@ void luaC_freeallobjects (lua_State *L) {
   for (i = 0; i < g->strt.size; i++)  /* free all string lists */
     sweepwholelist(L, &g->strt.hash[i]);
   lua_assert(g->strt.nuse == 0);
+  luaC_setfreer(L, 0);  /* wait for all pending blocks */
 }
 
 
@@ -1028,7 +1727,58 @@ static l_mem atomic (lua_State *L) {
 }
 
 
-static lu_mem singlestep (lua_State *L) {
+/*
+** {======================================================
+** Statistics
+** =======================================================
+*/
+
+/*
+** The collector reads the clock only when the program calls it (see
+** 'startpause') and when it changes state, so keeping statistics costs
+** a few clock readings per step.
+*/
+
+
+/* charge time since last reading of the clock to state 's' */
+static void chargetime (global_State *g, int s) {
+  lu_mem now = luai_gcclock();
+  g->gcstats.statetime[s] += now - g->gcstats.clock;
+  g->gcstats.clock = now;
+}
+
+
+/*
+** the program calls the collector; returns 0 if it was already running
+** (e.g., an emergency collection inside a step), in which case this
+** call is part of the outer one
+*/
+static int startpause (global_State *g) {
+  if (g->gcstats.inpause)
+    return 0;
+  g->gcstats.inpause = 1;
+  g->gcstats.pausestart = g->gcstats.clock = luai_gcclock();
+  return 1;
+}
+
+
+static void endpause (global_State *g, int started) {
+  if (started) {
+    lu_mem d;
+    chargetime(g, g->gcstate);
+    d = g->gcstats.clock - g->gcstats.pausestart;
+    g->gcstats.pauses++;
+    g->gcstats.pausetime += d;
+    if (d > g->gcstats.maxpause)
+      g->gcstats.maxpause = d;
+    g->gcstats.inpause = 0;
+  }
+}
+
+/* }====================================================== */
+
+
+static lu_mem statestep (lua_State *L) {
   global_State *g = G(L);
   switch (g->gcstate) {
     case GCSpause: {
@@ -1050,9 +1800,11 @@ static lu_mem singlestep (lua_State *L) {
       else {  /* no more `gray' objects */
         lu_mem work;
         int sw;
+        chargetime(g, GCSpropagate);
         g->gcstate = GCSatomic;  /* finish mark phase */
         g->GCestimate = g->GCmemtrav;  /* save what was counted */;
         work = atomic(L);  /* add what was traversed by 'atomic' */
+        chargetime(g, GCSatomic);
         g->GCestimate += work;  /* estimate of total memory traversed */ 
         sw = entersweep(L);
         return work + sw * GCSWEEPCOST;
@@ -1060,8 +1812,13 @@ static lu_mem singlestep (lua_State *L) {
     }
     case GCSsweepstring: {
       int i;
-      for (i = 0; i < GCSWEEPMAX && g->sweepstrgc + i < g->strt.size; i++)
-        sweepwholelist(L, &g->strt.hash[g->sweepstrgc + i]);
+      for (i = 0; i < GCSWEEPMAX && g->sweepstrgc + i < g->strt.size; i++) {
+        GCObject **p = &g->strt.hash[g->sweepstrgc + i];
+        /* new strings go to the front of their lists; in generational
+           mode, a list starting with an old string has no young ones */
+        if (*p != NULL && !(isgenerational(g) && isold(*p)))
+          sweepwholelist(L, p);
+      }
       g->sweepstrgc += i;
       if (g->sweepstrgc >= g->strt.size)  /* no more strings to sweep? */
         g->gcstate = GCSsweepudata;
@@ -1096,14 +1853,52 @@ static lu_mem singlestep (lua_State *L) {
 }
 
 
+/*
+** performs one step of the current state, counting what the sweep
+** phases free, the time spent in each state, and complete cycles
+*/
+static lu_mem singlestep (lua_State *L) {
+  global_State *g = G(L);
+  int state = g->gcstate;
+  lu_mem before = gettotalbytes(g);
+  lu_mem work = statestep(L);
+  if (GCSsweepstring <= state && state <= GCSsweep &&
+      gettotalbytes(g) < before)
+    g->gcstats.swept += before - gettotalbytes(g);
+  if (g->gcstate != state) {
+    chargetime(g, state);
+    if (g->gcstate == GCSpause)
+      g->gcstats.cycles++;
+  }
+  return work;
+}
+
+
 /*
 ** advances the garbage collector until it reaches a state allowed
 ** by 'statemask'
 */
 void luaC_runtilstate (lua_State *L, int statesmask) {
   global_State *g = G(L);
+  int started = startpause(g);
   while (!testbit(statesmask, g->gcstate))
     singlestep(L);
+  endpause(g, started);
+}
+
+
+/*
+** In generational mode, 'GCestimate' is the size of the heap after
+** the last major collection and 0 signals that the next collection
+** must be a major one. A minor collection only traverses objects
+** created since the previous collection, plus the remembered set:
+** old tables that got new references (linked in 'grayagain' by
+** 'luaC_barrierback_') and threads. So, minor collections are spaced
+** by 'gcminormul' percent of the heap, instead of by 'gcpause'.
+*/
+static l_mem minordebt (global_State *g) {
+  l_mem debt = cast(l_mem, (gettotalbytes(g) / 100) * g->gcminormul);
+  return (debt > GCSTEPSIZE) ? -debt : -GCSTEPSIZE;
 }
 
 
@@ -1119,8 +1914,44 @@ static void generationalcollection (lua_State *L) {
     luaC_runtilstate(L, bitmask(GCSpause));
     if (gettotalbytes(g) > (estimate / 100) * g->gcmajorinc)
       g->GCestimate = 0;  /* signal for a major collection */
+    else  /* the cycle overwrote 'GCestimate' with what it traversed */
+      g->GCestimate = estimate;  /* keep base for next major */
   }
-  luaE_setdebt(g, stddebt(g));
+  luaE_setdebt(g, minordebt(g));
+}
+
+
+/*
+** With a memory limit (see 'lua_gc'), the collector gets more eager as
+** the heap approaches it: a new cycle starts before half the remaining
+** room is used, and past half the limit each incremental step does
+** proportionally more work (up to LIMITMAXMUL times the usual amount).
+** An allocation that would still cross the limit does an emergency
+** collection and then fails with a memory error (see 'luaM_realloc_').
+*/
+#define LIMITMAXMUL	64
+
+
+static int limitstepmul (global_State *g, int stepmul) {
+  lu_mem total = gettotalbytes(g);
+  lu_mem half = g->GClimit / 2;
+  lu_mem room;
+  int mul;
+  if (g->GClimit == 0 || total <= half)
+    return stepmul;  /* no pressure */
+  room = (total < g->GClimit) ? g->GClimit - total : 0;
+  mul = (room <= half / LIMITMAXMUL) ? LIMITMAXMUL : cast_int(half / room);
+  return (stepmul < MAX_INT / mul) ? stepmul * mul : MAX_INT;
+}
+
+
+static void limitdebt (global_State *g) {
+  lu_mem total = gettotalbytes(g);
+  l_mem allow = (total < g->GClimit) ? cast(l_mem, (g->GClimit - total) / 2)
+                                     : 0;
+  if (allow < GCSTEPSIZE) allow = GCSTEPSIZE;  /* avoid too small steps */
+  if (-g->GCdebt > allow)
+    luaE_setdebt(g, -allow);
 }
 
 
@@ -1129,6 +1960,7 @@ static void incstep (lua_State *L) {
   l_mem debt = g->GCdebt;
   int stepmul = g->gcstepmul;
   if (stepmul < 40) stepmul = 40;  /* avoid ridiculous low values */
+  stepmul = limitstepmul(g, stepmul);
   /* convert debt from Kb to 'work units' (avoid zero debt and overflows) */
   debt = (debt / STEPMULADJ) + 1;
   debt = (debt < MAX_LMEM / stepmul) ? debt * stepmul : MAX_LMEM;
@@ -1144,14 +1976,62 @@ static void incstep (lua_State *L) {
 }
 
 
+/*
+** time-based pacing ('gcsteptime' > 0): each step works for about
+** 'gcsteptime' microseconds (a single state transition, such as the
+** atomic phase, cannot be split), and then lets the program run for
+** as long as needed to keep the collector at 'gccpufrac' percent of
+** the time. As steps can only be triggered by allocation, that
+** interval is converted into bytes with the allocation rate measured
+** since the previous step.
+*/
+static void timedstep (lua_State *L) {
+  global_State *g = G(L);
+  lu_mem start = luai_gcclock();
+  lu_mem mutator = start - g->GClasttime;  /* time since last step */
+  lu_mem allocated = gettotalbytes(g) - g->GClastbytes;
+  lu_mem elapsed;
+  l_mem debt;
+  do {  /* always perform at least one single step */
+    lu_mem work = 0;
+    do {  /* read the clock only every GCSTEPSIZE units of work */
+      work += singlestep(L);
+    } while (work < GCSTEPSIZE && g->gcstate != GCSpause);
+    elapsed = luai_gcclock() - start;
+  } while (elapsed < cast(lu_mem, g->gcsteptime) && g->gcstate != GCSpause);
+  if (g->gcstate == GCSpause)
+    debt = stddebtest(g, g->GCestimate);  /* pause until next cycle */
+  else {
+    int frac = g->gccpufrac;
+    debt = -GCSTEPSIZE;
+    if (g->GClasttime != 0 && mutator > 0 && frac < 100 &&
+        allocated < MAX_LMEM / 2) {
+      double quiet = cast(double, elapsed) * (100 - frac) / frac;
+      double bytes = quiet * cast(double, allocated) / cast(double, mutator);
+      if (bytes > cast(double, MAX_LMEM / 2))
+        bytes = cast(double, MAX_LMEM / 2);
+      if (bytes > GCSTEPSIZE)
+        debt = -cast(l_mem, bytes);
+    }
+  }
+  luaE_setdebt(g, debt);
+  g->GClasttime = luai_gcclock();
+  g->GClastbytes = gettotalbytes(g);
+}
+
+
 /*
 ** performs a basic GC step
 */
 void luaC_forcestep (lua_State *L) {
   global_State *g = G(L);
+  int started = startpause(g);
   int i;
   if (isgenerational(g)) generationalcollection(L);
+  else if (g->gcsteptime > 0) timedstep(L);
   else incstep(L);
+  if (g->GClimit != 0) limitdebt(g);
+  endpause(g, started);
   /* run a few finalizers (or all of them at the end of a collect cycle) */
   for (i = 0; g->tobefnz && (i < GCFINALIZENUM || g->gcstate == GCSpause); i++)
     GCTM(L, 1);  /* call one finalizer */
@@ -1177,6 +2057,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   int origkind = g->gckind;
   int someblack = keepinvariant(g);
+  int started;
   lua_assert(origkind != KGC_EMERGENCY);
   if (isemergency)  /* do not run finalizers during emergency GC */
     g->gckind = KGC_EMERGENCY;
@@ -1184,6 +2065,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
     g->gckind = KGC_NORMAL;
     callallpendingfinalizers(L, 1);
   }
+  started = startpause(g);
   if (someblack) {  /* may there be some black objects? */
     /* must sweep all objects to turn them back to white
        (as white has not changed, nothing will be collected) */
@@ -1193,6 +2075,16 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   luaC_runtilstate(L, bitmask(GCSpause));
   /* run entire collector */
   luaC_runtilstate(L, ~bitmask(GCSpause));
+  propagateall(g);  /* mark in one go (maybe in parallel) */
+  if (origkind == KGC_GEN && !isemergency) {  /* generational mode? */
+    /* sweep in generational mode, so that all survivors become old
+       (otherwise next minor collection would traverse them all); the
+       mode must change before 'atomic', whose 'entersweep' already
+       sweeps some objects: whitening a thread there would leave it
+       white in 'grayagain', which the next minor collection reuses */
+    g->gckind = KGC_GEN;
+    luaC_runtilstate(L, bitmask(GCSsweepstring));
+  }
   luaC_runtilstate(L, bitmask(GCSpause));
   if (origkind == KGC_GEN) {  /* generational mode? */
     /* generational mode must always start in propagate phase */
@@ -1200,8 +2092,13 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   }
   g->gckind = origkind;
   luaE_setdebt(g, stddebt(g));
+  endpause(g, started);
   if (!isemergency)   /* do not run finalizers during emergency GC */
     callallpendingfinalizers(L, 1);
+  else {  /* give back memory kept for reuse */
+    luaD_freestackcache(g);
+    luaE_trimthreadpool(L, 0);
+  }
 }
 
 /* }====================================================== */
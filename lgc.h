@@ -33,6 +33,16 @@
 #endif
 
 
+/* maximum number of threads marking objects in a collection */
+#if !defined(LUAI_MAXMARKERS)
+#if defined(LUA_USE_PTHREADS)
+#define LUAI_MAXMARKERS	16
+#else
+#define LUAI_MAXMARKERS	1
+#endif
+#endif
+
+
 /*
 ** Possible states of the Garbage Collector
 */
@@ -138,11 +148,15 @@ LUAI_FUNC void luaC_runtilstate (lua_State *L, int statesmask);
 LUAI_FUNC void luaC_fullgc (lua_State *L, int isemergency);
 LUAI_FUNC GCObject *luaC_newobj (lua_State *L, int tt, size_t sz,
                                  GCObject **list, int offset);
+LUAI_FUNC GCObject *luaC_linkobj (global_State *g, GCObject *o, int tt,
+                                  GCObject **list);
 LUAI_FUNC void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v);
 LUAI_FUNC void luaC_barrierback_ (lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_barrierproto_ (lua_State *L, Proto *p, Closure *c);
 LUAI_FUNC void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_checkupvalcolor (global_State *g, UpVal *uv);
 LUAI_FUNC void luaC_changemode (lua_State *L, int mode);
+LUAI_FUNC int luaC_setmarkers (lua_State *L, int n);
+LUAI_FUNC int luaC_setfreer (lua_State *L, int on);
 
 #endif
@@ -182,6 +182,21 @@ static int f_gc (lua_State *L) {
 }
 
 
+static int io_noclose (lua_State *L);
+
+
+/*
+** a cloned state must not close files of its template: its copies of
+** them are closed (except for the standard files, which are shared)
+*/
+static int f_clone (lua_State *L) {
+  LStream *p = tolstream(L);
+  if (p->closef != &io_noclose)
+    p->closef = NULL;
+  return 0;
+}
+
+
 /*
 ** function to close regular files
 */
@@ -508,8 +523,9 @@ static int g_write (lua_State *L, FILE *f, int arg) {
   for (; nargs--; arg++) {
     if (lua_type(L, arg) == LUA_TNUMBER) {
       /* optimization: could be done exactly as for strings */
-      status = status &&
-          fprintf(f, LUA_NUMBER_FMT, lua_tonumber(L, arg)) > 0;
+      char buff[LUAI_MAXNUMBER2STR];
+      size_t l = lua_fmtnumber(L, buff, lua_tonumber(L, arg), -1);
+      status = status && (fwrite(buff, sizeof(char), l, f) == l);
     }
     else {
       size_t l;
@@ -605,6 +621,7 @@ static const luaL_Reg flib[] = {
   {"seek", f_seek},
   {"setvbuf", f_setvbuf},
   {"write", f_write},
+  {"__clone", f_clone},
   {"__gc", f_gc},
   {"__tostring", f_tostring},
   {NULL, NULL}
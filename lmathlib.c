@@ -274,7 +274,8 @@ static const luaL_Reg mathlib[] = {
 ** Open math library
 */
 LUAMOD_API int luaopen_math (lua_State *L) {
-  luaL_newlib(L, mathlib);
+  luaL_newlibtable(L, mathlib);
+  luaL_setleaffuncs(L, mathlib);  /* none of them yields or calls Lua */
   lua_pushnumber(L, PI);
   lua_setfield(L, -2, "pi");
   lua_pushnumber(L, HUGE_VAL);
@@ -72,6 +72,33 @@ l_noret luaM_toobig (lua_State *L) {
 /*
 ** generic allocation routine.
 */
+/*
+** raise a memory error if growing by 'n' bytes would pass the limit
+*/
+static void checklimit (lua_State *L, size_t n) {
+  global_State *g = G(L);
+  if (g->GClimit != 0 && gettotalbytes(g) + n > g->GClimit) {
+    if (g->gcrunning)
+      luaC_fullgc(L, 1);  /* over the limit; try to free some memory... */
+    if (gettotalbytes(g) + n > g->GClimit)
+      luaD_throw(L, LUA_ERRMEM);
+  }
+}
+
+
+/*
+** account for memory that was not obtained through 'frealloc' (such
+** as a mapped stack) changing from 'osize' to 'nsize' bytes; may raise
+** an error only when growing
+*/
+void luaM_charge (lua_State *L, size_t osize, size_t nsize) {
+  global_State *g = G(L);
+  if (nsize > osize)
+    checklimit(L, nsize - osize);
+  g->GCdebt = (g->GCdebt + nsize) - osize;
+}
+
+
 void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   void *newblock;
   global_State *g = G(L);
@@ -81,6 +108,12 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   if (nsize > realosize && g->gcrunning)
     luaC_fullgc(L, 1);  /* force a GC whenever possible */
 #endif
+  if (nsize > realosize)
+    checklimit(L, nsize - realosize);
+  /* sample before reallocating: 'block' may be the stack being walked */
+  if (g->allocprof != NULL && nsize > realosize)  /* profiling? */
+    luaG_allocsample(L, (block == NULL) ? cast_int(osize) : LUA_TNIL,
+                        nsize - realosize);
   newblock = (*g->frealloc)(g->ud, block, osize, nsize);
   if (newblock == NULL && nsize > 0) {
     api_check(L, nsize > realosize,
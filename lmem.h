@@ -38,6 +38,7 @@
    ((v)=cast(t *, luaM_reallocv(L, v, oldn, n, sizeof(t))))
 
 LUAI_FUNC l_noret luaM_toobig (lua_State *L);
+LUAI_FUNC void luaM_charge (lua_State *L, size_t osize, size_t nsize);
 
 /* not to be called directly */
 LUAI_FUNC void *luaM_realloc_ (lua_State *L, void *block, size_t oldsize,
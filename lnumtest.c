@@ -0,0 +1,301 @@
+/*
+** $Id: lnumtest.c $
+** Check the fast number conversions of lobject.c against the C library
+** See Copyright Notice in lua.h
+*/
+
+/*
+** 'luaO_str2d' and 'luaO_fmtnum' avoid 'strtod' and 'sprintf' for
+** common numbers (see lobject.c). This program compares them with the
+** C library over every significant-digit count and decimal exponent
+** the fast paths accept (and the ones just outside them), over
+** integers, short decimals, powers of 10, special values, and random
+** bit patterns, with every precision. Results must be bit for bit the
+** same. Build and run it with 'make PLATFORM ALL=numtest'; run it again
+** after changing LUA_NUMBER_FMT, LUA_NUMBER_FMTPREC, or the handling of
+** the decimal point. An optional argument (NUMTEST_LOCALE in the
+** Makefile) names a locale to run the checks under.
+*/
+
+
+#include <float.h>
+#include <locale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define lnumtest_c
+#define LUA_CORE
+
+#include "lua.h"
+
+#include "lctype.h"
+#include "lobject.h"
+
+
+/* number of random mantissas for each digit count and exponent */
+#define NMANTISSAS	1000
+
+/* number of random bit patterns for 'luaO_fmtnum' */
+#define NPATTERNS	200000
+
+/* largest precision checked (the fast path stops at 15) */
+#define MAXPREC		17
+
+/* stop reporting after this many differences */
+#define MAXREPORT	10
+
+/* room for a numeral or a conversion */
+#define BUFFSIZE	(LUAI_MAXNUMBER2STR + MAXPREC + 64)
+
+
+static unsigned long nchecks = 0;
+static unsigned long ndiffs = 0;
+
+
+/*
+** {======================================================
+** Pseudo-random numbers (fixed seed, so that runs are repeatable)
+** =======================================================
+*/
+
+static unsigned long seed = 2463534242UL;
+
+static unsigned long nextrand (void) {  /* xorshift, 32 bits */
+  seed ^= (seed << 13) & 0xffffffffUL;
+  seed ^= seed >> 17;
+  seed ^= (seed << 5) & 0xffffffffUL;
+  return seed;
+}
+
+static int randint (int n) {  /* random number in [0, n) */
+  return (int)(nextrand() % (unsigned long)n);
+}
+
+/* }====================================================== */
+
+
+static int samenum (lua_Number a, lua_Number b) {
+  return memcmp(&a, &b, sizeof(lua_Number)) == 0 ||
+         (a != a && b != b);  /* any two NaNs */
+}
+
+
+static void report (const char *what, const char *input, const char *got,
+                    const char *expected) {
+  if (++ndiffs <= MAXREPORT)
+    fprintf(stderr, "%s(%s): got %s, expected %s\n",
+                    what, input, got, expected);
+}
+
+
+/*
+** {======================================================
+** String to number
+** =======================================================
+*/
+
+/* what 'luaO_str2d' does without its fast path */
+static int refstr2d (const char *s, size_t len, lua_Number *result) {
+  char *endptr;
+  if (strpbrk(s, "nN"))  /* reject 'inf' and 'nan' */
+    return 0;
+  else if (strpbrk(s, "xX"))  /* hexa? */
+    *result = lua_strx2number(s, &endptr);
+  else
+    *result = lua_str2number(s, &endptr);
+  if (endptr == s) return 0;
+  while (lisspace(cast_uchar(*endptr))) endptr++;
+  return (endptr == s + len);
+}
+
+
+static void checkstr2d (const char *s) {
+  lua_Number got, expected;
+  int okgot = luaO_str2d(s, strlen(s), &got);
+  int okexpected = refstr2d(s, strlen(s), &expected);
+  nchecks++;
+  if (okgot != okexpected || (okgot && !samenum(got, expected))) {
+    char g[BUFFSIZE], e[BUFFSIZE];
+    if (okgot) sprintf(g, "%.17g", (double)got); else strcpy(g, "(fail)");
+    if (okexpected) sprintf(e, "%.17g", (double)expected);
+    else strcpy(e, "(fail)");
+    report("luaO_str2d", s, g, e);
+  }
+}
+
+
+/*
+** writes the numeral 'digits' * 10^'exp' in a random form: with or
+** without sign, surrounding spaces, leading zeros, decimal point
+** ('point'), and exponent
+*/
+static void makenumeral (char *buff, const char *digits, int exp,
+                         char point) {
+  int nd = (int)strlen(digits);
+  int p = randint(nd + 1);  /* digits before the point */
+  int e = exp + nd - p;  /* exponent to write */
+  char *b = buff;
+  if (randint(4) == 0) *b++ = ' ';
+  switch (randint(3)) {
+    case 0: *b++ = '-'; break;
+    case 1: *b++ = '+'; break;
+    default: break;
+  }
+  if (p == 0 || randint(4) == 0) {  /* leading zeros */
+    int z = randint(3);
+    while (z-- > 0) *b++ = '0';
+  }
+  memcpy(b, digits, p);
+  b += p;
+  if (p < nd || randint(2) == 0) {  /* point (maybe a trailing one)? */
+    *b++ = point;
+    memcpy(b, digits + p, nd - p);
+    b += nd - p;
+  }
+  if (e != 0 || randint(2) == 0)
+    b += sprintf(b, "%c%d", "eE"[randint(2)], e);
+  if (randint(4) == 0) *b++ = '\t';
+  *b = '\0';
+}
+
+
+/*
+** every count of significant digits and every decimal exponent that
+** the fast path accepts, plus one more of each (which it must leave to
+** 'strtod'); mantissas are 10...0, 9...9, and random ones
+*/
+static void str2dtests (void) {
+  static const char *const plain[] = {"0", "-0", "0.0", ".5", "5.", "1e5",
+    "  12  ", "1e", "e1", ".", "-", "", " ", "1e+", "0x10", "1e1000",
+    "1e-1000", "1.5e22", "1e23", "123456789012345", "1234567890123456",
+    "9007199254740993", "0.1", "1 2", "1..2", "1.2.3", "00000000000000000001",
+    "0.00000000000000000000000000001", "inf", "nan", NULL};
+  char point = lua_getlocaledecpoint();
+  char digits[32];
+  char buff[BUFFSIZE];
+  int i, nd, exp, j;
+  for (i = 0; plain[i] != NULL; i++)
+    checkstr2d(plain[i]);
+  for (nd = 1; nd <= 16; nd++) {
+    for (exp = -23; exp <= 23; exp++) {
+      for (j = 0; j < NMANTISSAS; j++) {
+        for (i = 0; i < nd; i++) {
+          switch (j) {
+            case 0: digits[i] = (i == 0) ? '1' : '0'; break;
+            case 1: digits[i] = '9'; break;
+            default: digits[i] = (char)('0' + randint(10)); break;
+          }
+        }
+        if (digits[0] == '0') digits[0] = '1';
+        digits[nd] = '\0';
+        makenumeral(buff, digits, exp, '.');
+        checkstr2d(buff);
+        if (point != '.') {  /* also check the locale decimal point */
+          makenumeral(buff, digits, exp, point);
+          checkstr2d(buff);
+        }
+      }
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Number to string
+** =======================================================
+*/
+
+static void checkfmt (lua_Number n, int prec) {
+  char got[BUFFSIZE], expected[BUFFSIZE];
+  int l = luaO_fmtnum(got, n, prec);
+  int le = (prec < 0) ? lua_number2str(expected, n)
+                      : sprintf(expected, "%.*g", prec, (double)n);
+  nchecks++;
+  if (l != le || strcmp(got, expected) != 0) {
+    char input[BUFFSIZE];
+    sprintf(input, "%.17g, %d", (double)n, prec);
+    report("luaO_fmtnum", input, got, expected);
+  }
+}
+
+
+static void checkallprec (lua_Number n) {
+  int prec;
+  for (prec = -1; prec <= MAXPREC; prec++)
+    checkfmt(n, prec);
+  checkfmt(-n, -1);
+}
+
+
+static void fmttests (void) {
+  static const double special[] = {0.0, 1.0, 0.5, 1.5, 2.5, 9.5, 0.05,
+    0.0001, 0.00015, 0.000099999999999999991, 1e-5, 123456.5, 1e15 - 0.5,
+    1e15, 1e16, 1e17, 1e22, 1e23, 4503599627370496.5, 9007199254740992.0,
+    9007199254740993.0, DBL_MIN, DBL_MAX, DBL_EPSILON, 4.9e-324};
+  char buff[BUFFSIZE];
+  lua_Number n;
+  int i, k, j;
+  for (i = 0; i < (int)(sizeof(special) / sizeof(special[0])); i++)
+    checkallprec((lua_Number)special[i]);
+  checkallprec((lua_Number)HUGE_VAL);
+  n = (lua_Number)HUGE_VAL;
+  checkallprec(n - n);  /* NaN */
+  for (i = -100000; i <= 100000; i++)  /* small integers */
+    checkfmt((lua_Number)i, -1);
+  for (i = 0; i < 10000; i++)
+    checkallprec((lua_Number)i);
+  for (k = -30; k <= 30; k++) {  /* around powers of 10 */
+    lua_Number p = (lua_Number)pow(10.0, k);
+    checkallprec(p);
+    checkallprec(p * (1 - DBL_EPSILON));  /* neighbors of 'p' */
+    checkallprec(p * (1 + DBL_EPSILON));
+    for (j = 2; j <= 9; j++) checkallprec(p * j);
+  }
+  for (k = 0; k <= 20; k++) {  /* short decimals, as read from source */
+    for (j = 0; j < 300; j++) {
+      lua_Number m = (lua_Number)(nextrand() % 100000000UL);
+      if (j % 3 == 0)
+        m = m * 100000000 + (lua_Number)(nextrand() % 100000000UL);
+      sprintf(buff, "%.0fe-%d", (double)m, k);
+      checkallprec(lua_str2number(buff, NULL));
+      checkallprec(m / (lua_Number)pow(10.0, k));
+    }
+  }
+  for (i = 0; i < NPATTERNS; i++) {  /* random bit patterns */
+    unsigned char bytes[sizeof(lua_Number)];
+    for (j = 0; j < (int)sizeof(lua_Number); j++)
+      bytes[j] = (unsigned char)(nextrand() >> 8);
+    memcpy(&n, bytes, sizeof(lua_Number));
+    checkfmt(n, -1);
+    checkfmt(n, randint(MAXPREC + 1));
+  }
+}
+
+/* }====================================================== */
+
+
+int main (int argc, char **argv) {
+  const char *locale = (argc > 1) ? argv[1] : "C";
+  unsigned long total;
+  if (setlocale(LC_ALL, locale) == NULL) {
+    fprintf(stderr, "%s: cannot set locale '%s'\n", argv[0], locale);
+    return EXIT_FAILURE;
+  }
+  printf("locale '%s' (decimal point '%c'), LUA_NUMBER_FMT \"%s\"\n",
+         locale, lua_getlocaledecpoint(), LUA_NUMBER_FMT);
+  str2dtests();
+  printf("luaO_str2d: %lu numerals, %lu difference(s)\n", nchecks, ndiffs);
+  total = ndiffs;
+  nchecks = ndiffs = 0;
+  fmttests();
+  printf("luaO_fmtnum: %lu conversions, %lu difference(s)\n",
+         nchecks, ndiffs);
+  total += ndiffs;
+  return (total == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
@@ -4,6 +4,8 @@
 ** See Copyright Notice in lua.h
 */
 
+#include <locale.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -93,8 +95,6 @@ int luaO_hexavalue (int c) {
 
 #if !defined(lua_strx2number)
 
-#include <math.h>
-
 // 判断符号,并丢弃符号
 static int isneg (const char **s) {
   if (**s == '-') { (*s)++; return 1; }
@@ -159,8 +159,185 @@ static lua_Number lua_strx2number (const char *s, char **endptr) {
 #endif
 
 // 不直接使用libc的原因是?
+#if defined(LUA_NUMBER_DOUBLE)	/* { */
+
+/*
+** Fast paths for conversions between doubles and decimal strings.
+** Both rely on the fact that integers up to 2^53 and powers of 10 up
+** to 10^22 are exact doubles, and that IEEE operations on exact values
+** are correctly rounded: so, a decimal with at most 15 significant
+** digits and a small exponent converts with a single multiplication
+** or division, with the same result as a correct 'strtod'. Anything
+** else goes through the C library. 'lnumtest.c' checks both paths
+** against the C library ('make PLATFORM ALL=numtest').
+*/
+
+static const lua_Number pow10tab[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAXPOW10	(cast_int(sizeof(pow10tab) / sizeof(pow10tab[0])) - 1)
+
+/* maximum number of significant digits handled by the fast paths */
+#define MAXFASTDIGITS	15
+
+
+/*
+** tries to convert a plain decimal numeral (optional sign, digits,
+** optional fraction and exponent, surrounding spaces) with at most
+** MAXFASTDIGITS significant digits; returns 0 if 's' is not such a
+** numeral, so that the caller must use the general conversion
+*/
+static int fastscan (const char *s, size_t len, lua_Number *result) {
+  const char *e = s + len;
+  lua_Number m = 0;  /* significant digits, as an integer */
+  int nd = 0;  /* number of significant digits */
+  int exp = 0;  /* decimal exponent to apply to 'm' */
+  int neg = 0;
+  int any = 0;  /* seen any digit? */
+  while (s < e && lisspace(cast_uchar(*s))) s++;
+  if (s < e && (*s == '-' || *s == '+')) neg = (*s++ == '-');
+  for (; s < e && lisdigit(cast_uchar(*s)); s++, any = 1) {
+    if (nd > 0 || *s != '0') {  /* skip leading zeros */
+      if (++nd > MAXFASTDIGITS) return 0;
+      m = m * 10 + (*s - '0');
+    }
+  }
+  if (s < e && *s == '.') {
+    if (lua_getlocaledecpoint() != '.') return 0;  /* let 'strtod' decide */
+    for (s++; s < e && lisdigit(cast_uchar(*s)); s++, any = 1) {
+      if (nd > 0 || *s != '0') {
+        if (++nd > MAXFASTDIGITS) return 0;
+        m = m * 10 + (*s - '0');
+      }
+      exp--;
+    }
+  }
+  if (!any) return 0;
+  if (s < e && (*s == 'e' || *s == 'E')) {
+    int eneg = 0, ev = 0, edigits = 0;
+    s++;
+    if (s < e && (*s == '-' || *s == '+')) eneg = (*s++ == '-');
+    for (; s < e && lisdigit(cast_uchar(*s)); s++) {
+      if (++edigits > 3) return 0;  /* too large for the fast path */
+      ev = ev * 10 + (*s - '0');
+    }
+    if (edigits == 0) return 0;
+    exp += (eneg) ? -ev : ev;
+  }
+  while (s < e && lisspace(cast_uchar(*s))) s++;
+  if (s != e) return 0;  /* trailing characters (or embedded zeros) */
+  if (m == 0) exp = 0;  /* zero has no magnitude */
+  if (exp < -MAXPOW10 || exp > MAXPOW10) return 0;
+  m = (exp < 0) ? m / pow10tab[-exp] : m * pow10tab[exp];
+  *result = (neg) ? -m : m;
+  return 1;
+}
+
+
+/*
+** writes the digits of an integral value 0 <= m < 1e16 into 'buff';
+** returns number of chars written
+*/
+static int writedigits (char *buff, lua_Number m) {
+  char tmp[MAXFASTDIGITS + 1];
+  int n = 0;
+  int l = 0;
+  /* split 'm' in two parts that fit in an 'unsigned long' */
+  unsigned long hi = (unsigned long)(m / 1e8);
+  unsigned long lo = (unsigned long)(m - cast_num(hi) * 1e8);
+  do {  /* lower part (with all 8 digits if there is an upper part) */
+    tmp[n++] = cast(char, '0' + lo % 10);
+    lo /= 10;
+  } while (lo != 0 || (hi != 0 && n < 8));
+  while (hi != 0) {
+    tmp[n++] = cast(char, '0' + hi % 10);
+    hi /= 10;
+  }
+  while (n > 0) buff[l++] = tmp[--n];
+  return l;
+}
+
+
+/*
+** tries to write 'n' as '%.<prec>g' would do, for numbers that need no
+** rounding to 'prec' digits and use no exponent; returns 0 if it cannot
+*/
+static int fastfmt (char *buff, lua_Number n, int prec) {
+  lua_Number a = (n < 0) ? -n : n;
+  lua_Number limit;
+  int l = 0;
+  if (prec < 1 || prec > MAXFASTDIGITS) return 0;
+  limit = pow10tab[prec];
+  if (!(a < limit))  /* too large (or NaN)? */
+    return 0;
+  if (n < 0 || (n == 0 && 1/n < 0))  /* negative (including -0)? */
+    buff[l++] = '-';
+  if (a == floor(a))  /* integral value? */
+    return l + writedigits(buff + l, a);
+  else if (a >= 1e-4) {  /* '%g' would use fixed notation? */
+    int k;
+    for (k = 1; k <= MAXPOW10; k++) {  /* find 'k' decimal digits */
+      lua_Number m = a * pow10tab[k];
+      if (!(m < limit)) break;  /* too many digits */
+      if (m == floor(m)) {
+        char digits[MAXFASTDIGITS + 1];
+        int nd;
+        if (m / pow10tab[k] != a)  /* 'm' is not the exact decimal? */
+          break;
+        nd = writedigits(digits, m);
+        while (k > 0 && digits[nd - 1] == '0') {  /* remove trailing zeros */
+          nd--; k--;
+        }
+        if (nd > k) {  /* has integral part? */
+          memcpy(buff + l, digits, nd - k);
+          l += nd - k;
+        }
+        else buff[l++] = '0';
+        buff[l++] = lua_getlocaledecpoint();
+        for (; k > nd; k--) buff[l++] = '0';  /* leading fraction zeros */
+        memcpy(buff + l, digits + nd - k, k);
+        return l + k;
+      }
+    }
+  }
+  return 0;
+}
+
+#endif			/* } */
+
+
+/*
+** converts 'n' to a string as '%.<prec>g' would do or, if 'prec' is
+** negative, as LUA_NUMBER_FMT does; returns length of the result
+*/
+int luaO_fmtnum (char *buff, lua_Number n, int prec) {
+#if defined(LUA_NUMBER_DOUBLE)
+  int l;
+#if defined(LUA_NUMBER_FMTPREC)
+  l = fastfmt(buff, n, (prec < 0) ? LUA_NUMBER_FMTPREC : prec);
+#else
+  l = (prec < 0) ? 0 : fastfmt(buff, n, prec);
+#endif
+  if (l > 0) {
+    buff[l] = '\0';
+    return l;
+  }
+#endif
+  if (prec < 0)
+    return lua_number2str(buff, n);
+  else
+    return sprintf(buff, "%.*g", prec, (double)n);
+}
+
+
 int luaO_str2d (const char *s, size_t len, lua_Number *result) {
   char *endptr;
+#if defined(LUA_NUMBER_DOUBLE)
+  if (fastscan(s, len, result))  /* common case? */
+    return 1;
+#endif
   if (strpbrk(s, "nN"))  /* reject 'inf' and 'nan' */
     return 0;
   else if (strpbrk(s, "xX"))  /* hexa? */
@@ -242,6 +242,8 @@ OP_CLOSURE,/*	A Bx	R(A) := closure(KPROTO[Bx])			*/
 // nvarargs = B - 1
 OP_VARARG,/*	A B	R(A), R(A+1), ..., R(A+B-2) = vararg		*/
 
+OP_VARSELECT,/*	A B	select(R(A-1), ...) when R(A-2) is 'select', else VARARG */
+
 OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 } OpCode;
 
@@ -261,6 +263,10 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 
   (*) In OP_RETURN, if (B == 0) then return up to `top'.
 
+  (*) OP_VARSELECT is the OP_VARARG (B == 0) of a call 'select(x, ...)'.
+  When R(A-2) is the base library 'select', it does the whole call and
+  skips the following OP_CALL/OP_TAILCALL.
+
   (*) In OP_SETLIST, if (B == 0) then B = `top'; if (C == 0) then next
   'instruction' is EXTRAARG(real C).
 
@@ -279,7 +279,18 @@ static int os_setlocale (lua_State *L) {
      "numeric", "time", NULL};
   const char *l = luaL_optstring(L, 1, NULL);
   int op = luaL_checkoption(L, 2, "all", catnames);
-  lua_pushstring(L, setlocale(cat[op], l));
+  const char *res = setlocale(cat[op], l);
+  if (res != NULL && l != NULL &&
+      (cat[op] == LC_ALL || cat[op] == LC_CTYPE)) {
+    /* character classes changed; flush compiled patterns */
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_PATCACHEKEY);
+    if (lua_isuserdata(L, -1)) {
+      lua_newtable(L);
+      lua_setuservalue(L, -2);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pushstring(L, res);
   return 1;
 }
 
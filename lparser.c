@@ -898,11 +898,27 @@ static void primaryexp (LexState *ls, expdesc *v) {
 }
 
 
+/*
+** a call 'select(x, ...)' (with 'select' a plain name) becomes an
+** OP_VARSELECT instead of its OP_VARARG, so that the VM can answer it
+** without copying the varargs when 'select' is the standard one
+*/
+static void varselect (FuncState *fs, expdesc *call) {
+  Instruction *pv = &getcode(fs, call) - 1;  /* instruction before call */
+  int base = GETARG_A(getcode(fs, call));
+  if (GET_OPCODE(*pv) == OP_VARARG && GETARG_B(*pv) == 0 &&
+      GETARG_A(*pv) == base + 2)  /* exactly one argument before '...'? */
+    SET_OPCODE(*pv, OP_VARSELECT);
+}
+
+
 static void suffixedexp (LexState *ls, expdesc *v) {
   /* suffixedexp ->
        primaryexp { '.' NAME | '[' exp ']' | ':' NAME funcargs | funcargs } */
   FuncState *fs = ls->fs;
   int line = ls->linenumber;
+  int isselect = (ls->t.token == TK_NAME &&
+                  strcmp(getstr(ls->t.seminfo.ts), "select") == 0);
   primaryexp(ls, v);
   for (;;) {
     switch (ls->t.token) {
@@ -928,10 +944,12 @@ static void suffixedexp (LexState *ls, expdesc *v) {
       case '(': case TK_STRING: case '{': {  /* funcargs */
         luaK_exp2nextreg(fs, v);
         funcargs(ls, v, line);
+        if (isselect) varselect(fs, v);
         break;
       }
       default: return;
     }
+    isselect = 0;  /* only a direct call to the name */
   }
 }
 
@@ -14,6 +14,7 @@
 #include "lua.h"
 
 #include "lapi.h"
+#include "lclone.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -34,11 +35,40 @@
 #define LUAI_GCMAJOR	200  /* 200% */
 #endif
 
+#if !defined(LUAI_GCMINOR)
+#define LUAI_GCMINOR	20  /* 20% */
+#endif
+
+#if !defined(LUAI_THREADPOOL)
+#define LUAI_THREADPOOL	256  /* dead threads kept for reuse */
+#endif
+
+/* threads with larger stacks, or more spare 'ci's, are not kept whole */
+#define POOLSTACKMAX	512
+#define POOLCIMAX	16
+
+/* pooled threads are linked through their 'next' field */
+#define nextpooled(L1)	cast(lua_State *, (L1)->next)
+
 #if !defined(LUAI_GCMUL)
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
 
+#if !defined(LUAI_GCCPUFRAC)
+#define LUAI_GCCPUFRAC	50  /* GC may use half the time when paced by time */
+#endif
+
+#if !defined(LUAI_GCMARKERS)
+#define LUAI_GCMARKERS	1  /* mark in the running thread only */
+#endif
+
+
+#if !defined(LUAI_DEFCOLLATION)
+#define LUAI_DEFCOLLATION	LUA_COLLLOCALE  /* use 'strcoll' */
+#endif
+
+
 #define MEMERRMSG	"not enough memory"
 
 
@@ -136,21 +166,19 @@ void luaE_freeCI (lua_State *L) {
   }
 }
 
-// L1是newthread出来的
-static void stack_init (lua_State *L1, lua_State *L) {
+/*
+** set up an empty stack in 'L1', which may be a reused thread
+*/
+static void resetstack (lua_State *L1) {
   int i; CallInfo *ci;
-  /* initialize stack array */
-  // 初始栈大小:40
-  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
-  L1->stacksize = BASIC_STACK_SIZE;
-  for (i = 0; i < BASIC_STACK_SIZE; i++)
+  for (i = 0; i < L1->stacksize; i++)
     setnilvalue(L1->stack + i);  /* erase new stack */
   L1->top = L1->stack;
   // 空余EXTRA_STACK备用
   L1->stack_last = L1->stack + L1->stacksize - EXTRA_STACK;
   /* initialize first ci */
   ci = &L1->base_ci;
-  ci->next = ci->previous = NULL;
+  ci->previous = NULL;  /* keep spare 'ci's in 'next' */
   ci->callstatus = 0;
   ci->func = L1->top;
   // base_ci指向为nil,仅作为哨兵而已
@@ -161,12 +189,23 @@ static void stack_init (lua_State *L1, lua_State *L) {
 }
 
 
+// L1是newthread出来的
+static void stack_init (lua_State *L1, lua_State *L) {
+  /* initialize stack array */
+  // 初始栈大小:40
+  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
+  L1->stacksize = BASIC_STACK_SIZE;
+  L1->base_ci.next = NULL;
+  resetstack(L1);
+}
+
+
 static void freestack (lua_State *L) {
   if (L->stack == NULL)
     return;  /* stack not completely built yet */
   L->ci = &L->base_ci;  /* free the entire 'ci' list */
   luaE_freeCI(L);
-  luaM_freearray(L, L->stack, L->stacksize);  /* free stack array */
+  luaD_freestack(L);  /* free stack array */
 }
 
 
@@ -192,6 +231,9 @@ static void init_registry (lua_State *L, global_State *g) {
   sethvalue(L, &mt, luaH_new(L));
   // global表没有值
   luaH_setint(L, registry, LUA_RIDX_GLOBALS, &mt);
+  /* registry[LUA_RIDX_SELECT] = false (until the base library sets it) */
+  setbvalue(&mt, 0);
+  luaH_setint(L, registry, LUA_RIDX_SELECT, &mt);
 }
 
 
@@ -215,6 +257,7 @@ static void f_luaopen (lua_State *L, void *ud) {
 
   // strtab/metamethod/key 都用了下面的方式,标记永远不用回收
   luaS_fix(g->memerrmsg);  /* it should never be collected */
+  luaC_setmarkers(L, LUAI_GCMARKERS);
   g->gcrunning = 1;  /* allow gc */
 }
 
@@ -228,8 +271,11 @@ static void preinit_state (lua_State *L, global_State *g) {
   L->stack = NULL;
   L->ci = NULL;
   L->stacksize = 0;
+  L->stackcharged = 0;
+  L->stackmapped = 0;
   L->errorJmp = NULL;
   L->nCcalls = 0;
+  L->baseCcalls = 0;
   L->hook = NULL;
   L->hookmask = 0;
   L->basehookcount = 0;
@@ -246,22 +292,39 @@ static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeallobjects(L);  /* collect all objects */
-  luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
-  luaZ_freebuffer(L, &g->buff);
-  freestack(L);
-  lua_assert(gettotalbytes(g) == sizeof(LG));
+  luaG_freeallocprof(g);
+  if (!g->arena) {  /* else allocator frees everything with main block */
+    luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
+    luaZ_freebuffer(L, &g->buff);
+    luaE_trimthreadpool(L, 0);
+    freestack(L);
+    luaD_freestackcache(g);
+    luaC_setmarkers(L, 1);  /* free marker states */
+    lua_assert(gettotalbytes(g) == sizeof(LG));
+  }
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
 }
 
 // newthread之后的state由GC回收
 LUA_API lua_State *lua_newthread (lua_State *L) {
   lua_State *L1;
+  StkId stack = NULL;
+  int stacksize = 0;
   lua_lock(L);
   luaC_checkGC(L);
 
   // FIXME: 没看出来LX的buff的作用
   // gc创建唯一的offset使用处
-  L1 = &luaC_newobj(L, LUA_TTHREAD, sizeof(LX), NULL, offsetof(LX, l))->th;
+  L1 = G(L)->threadpool;
+  if (L1 != NULL) {  /* reuse a dead thread, with its stack and 'ci' list */
+    G(L)->threadpool = nextpooled(L1);
+    G(L)->nthreadpool--;
+    stack = L1->stack;
+    stacksize = L1->stacksize;
+    luaC_linkobj(G(L), obj2gco(L1), LUA_TTHREAD, NULL);
+  }
+  else
+    L1 = &luaC_newobj(L, LUA_TTHREAD, sizeof(LX), NULL, offsetof(LX, l))->th;
 
   // 返回值就是新的L1
   setthvalue(L, L->top, L1);
@@ -273,24 +336,73 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   L1->hook = L->hook;
   resethookcount(L1);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  if (stack != NULL) {  /* reused thread? */
+    L1->stack = stack;
+    L1->stacksize = stacksize;
+    resetstack(L1);
+  }
+  else
+    stack_init(L1, L);  /* init stack */
   lua_unlock(L);
   return L1;
 }
 
 
+/*
+** keep a dead thread in the pool (if there is room and its stack is
+** not too big), after freeing all but POOLCIMAX of its spare 'ci's
+*/
+static int poolthread (global_State *g, lua_State *L1) {
+  CallInfo *ci = &L1->base_ci;
+  int n = 0;
+  if (g->nthreadpool >= g->threadpoolmax || L1->stack == NULL ||
+      L1->stackmapped || L1->stacksize > POOLSTACKMAX)
+    return 0;
+  while (ci->next != NULL && n++ < POOLCIMAX)
+    ci = ci->next;
+  L1->ci = ci;
+  luaE_freeCI(L1);  /* free the others */
+  L1->ci = &L1->base_ci;
+  L1->next = obj2gco(g->threadpool);
+  g->threadpool = L1;
+  g->nthreadpool++;
+  return 1;
+}
+
+
 void luaE_freethread (lua_State *L, lua_State *L1) {
   LX *l = fromstate(L1);
   luaF_close(L1, L1->stack);  /* close all upvalues for this thread */
   lua_assert(L1->openupval == NULL);
   luai_userstatefree(L, L1);
+  if (poolthread(G(L), L1))
+    return;
   freestack(L1);
   luaM_free(L, l);
 }
 
+
+/*
+** free pooled threads until there are at most 'max' of them
+*/
+void luaE_trimthreadpool (lua_State *L, int max) {
+  global_State *g = G(L);
+  while (g->nthreadpool > max) {
+    lua_State *L1 = g->threadpool;
+    g->threadpool = nextpooled(L1);
+    g->nthreadpool--;
+    freestack(L1);
+    luaM_free(L, fromstate(L1));
+  }
+}
+
 // 独立的state
 // 没有使用luaC_newobj,主要是因为绑定的G和GC特殊标记
-LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
+/*
+** create a new state; a state cloned from 'from' gets the same seed,
+** so that its strings hash (and its tables are laid out) the same way
+*/
+static lua_State *newstate (lua_Alloc f, void *ud, global_State *from) {
   int i;
   lua_State *L;
   global_State *g;
@@ -314,7 +426,7 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L;
-  g->seed = makeseed(L);
+  g->seed = (from != NULL) ? from->seed : makeseed(L);
   g->uvhead.u.l.prev = &g->uvhead;
   g->uvhead.u.l.next = &g->uvhead;
   g->gcrunning = 0;  /* no GC while building state */
@@ -333,11 +445,31 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->sweepgc = g->sweepfin = NULL;
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
+  g->markers = NULL;
+  g->markerstates = NULL;
+  g->freer = NULL;
+  g->ephpending = NULL;
+  g->stackcache = NULL;
+  g->nstackcache = 0;
+  g->threadpool = NULL;
+  g->nthreadpool = 0;
+  g->threadpoolmax = LUAI_THREADPOOL;
+  g->allocprof = NULL;
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
+  g->GClimit = 0;  /* no limit */
   g->gcpause = LUAI_GCPAUSE;
   g->gcmajorinc = LUAI_GCMAJOR;
+  g->gcminormul = LUAI_GCMINOR;
   g->gcstepmul = LUAI_GCMUL;
+  g->gcsteptime = 0;  /* pace by bytes */
+  g->gccpufrac = LUAI_GCCPUFRAC;
+  g->GClasttime = 0;
+  g->GClastbytes = 0;
+  memset(&g->gcstats, 0, sizeof(g->gcstats));
+  g->collation = LUAI_DEFCOLLATION;
+  g->gcmarkers = 1;  /* see 'f_luaopen' */
+  g->arena = 0;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
@@ -350,6 +482,52 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
 }
 
 
+LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
+  return newstate(f, ud, NULL);
+}
+
+
+/*
+** Create a state with a copy of everything reachable from the registry
+** of 'from' (see lclone.c). Returns NULL if there is not enough memory,
+** if 'from' has coroutines, or if it has userdata that cannot be copied;
+** then the error message is pushed on the stack of 'from'.
+*/
+LUA_API lua_State *lua_clonestate (lua_State *from, lua_Alloc f, void *ud) {
+  lua_State *L = newstate(f, ud, G(from));
+  int status = (L == NULL) ? LUA_ERRMEM : luaE_clone(L, from);
+  if (status != LUA_OK) {
+    const char *msg;
+    switch (status) {  /* see 'seterrorobj' */
+      case LUA_ERRMEM: msg = MEMERRMSG; break;
+      case LUA_ERRERR: msg = "error in error handling"; break;
+      default: {  /* error object is on the stack of 'L' */
+        msg = ttisstring(L->top - 1) ? svalue(L->top - 1)
+                                     : "error object is not a string";
+        break;
+      }
+    }
+    lua_pushstring(from, msg);  /* before 'msg' goes away with 'L' */
+    if (L != NULL) close_state(L);
+    L = NULL;
+  }
+  return L;
+}
+
+
+/*
+** Create a state whose allocator releases all memory when the main
+** block is freed: 'lua_close' calls all pending finalizers and then
+** frees only that block, instead of each object.
+*/
+LUA_API lua_State *lua_newarena (lua_Alloc f, void *ud) {
+  lua_State *L = lua_newstate(f, ud);
+  if (L != NULL)
+    G(L)->arena = 1;
+  return L;
+}
+
+
 LUA_API void lua_close (lua_State *L) {
   L = G(L)->mainthread;  /* only the main thread can be closed */
   lua_lock(L);
@@ -114,6 +114,31 @@ typedef struct CallInfo {
 
 #define isLua(ci)	((ci)->callstatus & CIST_LUA)
 
+/*
+** number of varargs of a Lua call with 'np' parameters; a call with no
+** extra arguments keeps its parameters in place (see 'adjust_varargs')
+*/
+#define nvarargs(ci,np)	((ci)->u.l.base == (ci)->func + 1 ? 0 : \
+			  cast_int((ci)->u.l.base - (ci)->func) - (np) - 1)
+
+
+/*
+** statistics kept by the collector (see 'lua_getgcstats'); times are
+** in microseconds
+*/
+typedef struct GCStats {
+  lu_mem cycles;  /* number of complete cycles */
+  lu_mem pauses;  /* number of times the collector ran */
+  lu_mem pausetime;  /* total time of those runs */
+  lu_mem maxpause;  /* longest run */
+  lu_mem swept;  /* bytes freed by the sweep phases */
+  lu_mem statetime[6];  /* time spent in each GC state */
+  lu_mem objects[LUA_TUPVAL + 1];  /* live objects by type */
+  lu_mem clock;  /* last reading of the clock */
+  lu_mem pausestart;  /* clock when current run started */
+  int inpause;  /* true while the collector runs */
+} GCStats;
+
 
 /*
 ** `global state', shared by all threads of this state
@@ -130,6 +155,7 @@ typedef struct global_State {
   l_mem GCdebt;  /* bytes allocated not yet compensated by the collector */
   lu_mem GCmemtrav;  /* memory traversed by the GC */
   lu_mem GCestimate;  /* an estimate of the non-garbage memory in use */
+  lu_mem GClimit;  /* maximum number of bytes in use (0: no limit) */
 
   stringtable strt;  /* hash table for strings */
 
@@ -143,6 +169,9 @@ typedef struct global_State {
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
   lu_byte gcrunning;  /* true if GC is running */
+  lu_byte collation;  /* how strings are ordered (LUA_COLL*) */
+  lu_byte gcmarkers;  /* number of threads marking objects */
+  lu_byte arena;  /* true if allocator frees all memory with the state */
   int sweepstrgc;  /* position of sweep in `strt' */
   
   // 单指针的,应该是真正的list
@@ -162,6 +191,16 @@ typedef struct global_State {
   GCObject *ephemeron;  /* list of ephemeron tables (weak keys) */
   GCObject *allweak;  /* list of all-weak tables */
   GCObject *tobefnz;  /* list of userdata to be GC */
+  struct Markers *markers;  /* parallel markers (NULL if marking serially) */
+  struct global_State *markerstates;  /* states for extra markers */
+  struct Freer *freer;  /* background freeing thread (NULL if none) */
+  struct EphPending *ephpending;  /* pending ephemeron entries (or NULL) */
+  TValue *stackcache;  /* free stack mappings kept for reuse */
+  struct lua_State *threadpool;  /* dead threads kept for reuse */
+  int nthreadpool;  /* number of threads in 'threadpool' */
+  int threadpoolmax;  /* maximum size of 'threadpool' */
+  lu_byte nstackcache;  /* number of mappings in 'stackcache' */
+  struct AllocProf *allocprof;  /* allocation profile (NULL if not profiling) */
 
   // 所有open的upvalue
   UpVal uvhead;  /* head of double-linked list of all open upvalues */
@@ -171,7 +210,13 @@ typedef struct global_State {
   // GC参数
   int gcpause;  /* size of pause between successive GCs */
   int gcmajorinc;  /* how much to wait for a major GC (only in gen. mode) */
+  int gcminormul;  /* how much to wait for a minor GC (only in gen. mode) */
   int gcstepmul;  /* GC `granularity' */
+  int gcsteptime;  /* max. duration of a GC step in usec. (0: by bytes) */
+  int gccpufrac;  /* % of time for the GC when pacing by time */
+  lu_mem GClasttime;  /* clock at the end of last timed step */
+  lu_mem GClastbytes;  /* total bytes at the end of last timed step */
+  GCStats gcstats;
 
   // luaD_throw在abort之前的处理参数
   lua_CFunction panic;  /* to be called in unprotected errors */
@@ -211,9 +256,12 @@ struct lua_State {
   StkId stack_last;  /* last free slot in the stack */
   StkId stack;  /* stack base */
   int stacksize;
+  int stackcharged;  /* slots charged for a mapped stack (its peak size) */
+  lu_byte stackmapped;  /* true if stack has its own mapping */
 
   unsigned short nny;  /* number of non-yieldable calls in stack */
   unsigned short nCcalls;  /* number of nested C calls */
+  unsigned short baseCcalls;  /* 'nCcalls' of the running 'lua_resume' */
 
   // hook
   lu_byte hookmask;
@@ -281,6 +329,7 @@ union GCObject {
 
 LUAI_FUNC void luaE_setdebt (global_State *g, l_mem debt);
 LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
+LUAI_FUNC void luaE_trimthreadpool (lua_State *L, int max);
 LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
 LUAI_FUNC void luaE_freeCI (lua_State *L);
 
@@ -6,6 +6,7 @@
 
 
 #include <ctype.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,6 +20,10 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
+#if defined(LUA_USE_SSE2)
+#include <emmintrin.h>
+#endif
+
 
 /*
 ** maximum number of captures that a pattern can do during
@@ -65,25 +70,89 @@ static int str_sub (lua_State *L) {
 
 // ֱ޸ԭַ
 static int str_reverse (lua_State *L) {
-  size_t l, i;
+  size_t l, i = 0;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i = 0; i < l; i++)
+#if defined(LUA_USE_SSE2)
+  for (; l - i >= 16; i += 16) {  /* reverse blocks of 16 chars */
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + l - i - 16));
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));  /* swap dwords */
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));  /* swap words */
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));  /* bytes */
+    _mm_storeu_si128((__m128i *)(p + i), v);
+  }
+#endif
+  for (; i < l; i++)
     p[i] = s[l - i - 1];
   luaL_pushresultsize(&b, l);
   return 1;
 }
 
 
+/* minimum length for case conversions to build a translation table */
+#define CASEMINLEN	128
+
+
+/*
+** fills 'tab' with the case conversion of each char in the current
+** locale; returns true if that conversion is the plain ASCII one
+*/
+static int casetable (unsigned char *tab, int upper) {
+  int c;
+  int ascii = 1;
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    int a = c;  /* ASCII conversion of 'c' */
+    if (upper) {
+      tab[c] = uchar(toupper(c));
+      if ('a' <= c && c <= 'z') a = c - ('a' - 'A');
+    }
+    else {
+      tab[c] = uchar(tolower(c));
+      if ('A' <= c && c <= 'Z') a = c + ('a' - 'A');
+    }
+    if (tab[c] != a) ascii = 0;
+  }
+  return ascii;
+}
+
+
+static void strcase (char *p, const char *s, size_t l, int upper) {
+  unsigned char tab[UCHAR_MAX + 1];
+  size_t i = 0;
+  if (l < CASEMINLEN) {  /* short string? convert char by char */
+    for (; i < l; i++)
+      p[i] = (upper) ? toupper(uchar(s[i])) : tolower(uchar(s[i]));
+    return;
+  }
+#if defined(LUA_USE_SSE2)
+  if (casetable(tab, upper)) {  /* plain ASCII conversion? */
+    /* move letters of the wrong case to [-128, -103] and flip their case */
+    const __m128i base = _mm_set1_epi8((char)(0x80 - (upper ? 'a' : 'A')));
+    const __m128i lim = _mm_set1_epi8((char)(0x80 + 26));
+    const __m128i flip = _mm_set1_epi8('a' - 'A');
+    for (; l - i >= 16; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      __m128i m = _mm_cmplt_epi8(_mm_add_epi8(v, base), lim);
+      _mm_storeu_si128((__m128i *)(p + i),
+                       _mm_xor_si128(v, _mm_and_si128(m, flip)));
+    }
+  }
+#else
+  casetable(tab, upper);
+#endif
+  for (; i < l; i++)
+    p[i] = (char)tab[uchar(s[i])];
+}
+
+
 static int str_lower (lua_State *L) {
   size_t l;
-  size_t i;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = tolower(uchar(s[i]));
+  strcase(p, s, l, 0);
   luaL_pushresultsize(&b, l);
   return 1;
 }
@@ -91,12 +160,10 @@ static int str_lower (lua_State *L) {
 
 static int str_upper (lua_State *L) {
   size_t l;
-  size_t i;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = toupper(uchar(s[i]));
+  strcase(p, s, l, 1);
   luaL_pushresultsize(&b, l);
   return 1;
 }
@@ -115,15 +182,21 @@ static int str_rep (lua_State *L) {
     return luaL_error(L, "resulting string too large");
   else {
     size_t totallen = n * l + (n - 1) * lsep;
+    size_t done;
     luaL_Buffer b;
     char *p = luaL_buffinitsize(L, &b, totallen);
-    while (n-- > 1) {  /* first n-1 copies (followed by separator) */
-      memcpy(p, s, l * sizeof(char)); p += l;
-      if (lsep > 0) {  /* avoid empty 'memcpy' (may be expensive) */
-        memcpy(p, sep, lsep * sizeof(char)); p += lsep;
-      }
+    /* result is 's' followed by 'sep' repeated, cut at 'totallen' */
+    memcpy(p, s, l * sizeof(char));
+    done = l;
+    if (n > 1 && lsep > 0) {  /* avoid empty 'memcpy' (may be expensive) */
+      memcpy(p + l, sep, lsep * sizeof(char));
+      done += lsep;
+    }
+    while (done < totallen) {  /* double the copied part at each step */
+      size_t c = (done < totallen - done) ? done : totallen - done;
+      memcpy(p + done, p, c * sizeof(char));
+      done += c;
     }
-    memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
     luaL_pushresultsize(&b, totallen);
   }
   return 1;
@@ -191,13 +264,102 @@ static int str_dump (lua_State *L) {
 */
 
 
+/*
+** number of compiled patterns kept by the pattern cache. Must be a
+** power of 2.
+*/
+#if !defined(LUA_PATCACHESIZE)
+#define LUA_PATCACHESIZE	64
+#endif
+
+
 #define CAP_UNFINISHED	(-1)
 #define CAP_POSITION	(-2)
 
+
+#define L_ESC		'%'
+#define SPECIALS	"^$*+?.([%-"
+
+
+/*
+** Patterns are compiled into a sequence of items before matching.
+** Each single-char class ('.', '%a', '[...]') becomes a 256-bit set,
+** so that matching a char against it is a single bit test. Malformed
+** constructions become a PI_ERROR item, so that the error is raised
+** only if (and when) the matcher reaches that point, exactly as when
+** the pattern was interpreted directly.
+*/
+
+/* kinds of pattern items */
+#define PI_CHAR		0	/* a plain char 'c1' */
+#define PI_SET		1	/* a char in set 'set' */
+#define PI_OPEN		2	/* start of a capture */
+#define PI_POSITION	3	/* position capture '()' */
+#define PI_CLOSE	4	/* end of a capture */
+#define PI_EOS		5	/* '$' at the end of the pattern */
+#define PI_BALANCE	6	/* '%b' with delimiters 'c1' and 'c2' */
+#define PI_FRONTIER	7	/* '%f' with set 'set' */
+#define PI_BACKREF	8	/* '%1'-'%9' with digit 'c1' */
+#define PI_ERROR	9	/* malformed pattern; message 'c1' */
+
+
+static const char *const patterrors[] = {
+  "malformed pattern (ends with " LUA_QL("%") ")",
+  "malformed pattern (missing " LUA_QL("]") ")",
+  "malformed pattern (missing arguments to " LUA_QL("%b") ")",
+  "missing " LUA_QL("[") " after " LUA_QL("%f") " in pattern"
+};
+
+/* indices into 'patterrors' */
+#define PE_ESCEND	0
+#define PE_BRACKET	1
+#define PE_BALANCE	2
+#define PE_FRONTIER	3
+
+
+typedef struct CharSet {
+  unsigned char b[(UCHAR_MAX + 1) / CHAR_BIT];
+} CharSet;
+
+#define testset(cs,c)	((cs)->b[(c) / CHAR_BIT] & (1u << ((c) % CHAR_BIT)))
+#define addset(cs,c)	\
+	((cs)->b[(c) / CHAR_BIT] |= (unsigned char)(1u << ((c) % CHAR_BIT)))
+
+
+typedef struct PatItem {
+  unsigned char op;  /* kind of item (PI_*) */
+  unsigned char rep;  /* repetition suffix ('?', '*', '+', '-') or 0 */
+  unsigned char c1, c2;  /* chars (meaning depends on 'op') */
+  int set;  /* index of item's set (PI_SET and PI_FRONTIER) */
+} PatItem;
+
+
+/*
+** A compiled pattern is followed, in the same block, by its 'nitems'
+** items, its 'nsets' sets, and its prefix; the block holds no
+** addresses, so it can be copied as it is (see lclone.c).
+*/
+typedef struct Pattern {
+  int nitems;
+  int nsets;
+  int anchor;  /* true if pattern must match at subject start */
+  size_t lprefix;  /* length of literal prefix of every match */
+  int nfirst;  /* number of chars in 'first' (-1 if not computed) */
+  unsigned char firstc[4];  /* chars in 'first', when there are few */
+  CharSet first;  /* chars that can start a match */
+} Pattern;
+
+#define patitems(pat)	((PatItem *)((pat) + 1))
+#define patsets(pat)	((CharSet *)(patitems(pat) + (pat)->nitems))
+#define patprefix(pat)	((char *)(patsets(pat) + (pat)->nsets))
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
-  const char *p_end;  /* end ('\0') of pattern */
+  const Pattern *pat;  /* compiled pattern */
+  const PatItem *p_end;  /* end of pattern items */
+  const CharSet *set;  /* sets of pattern */
   lua_State *L;
   int level;  /* total number of captures (finished or unfinished) */
   struct {
@@ -207,10 +369,6 @@ typedef struct MatchState {
 } MatchState;
 
 
-#define L_ESC		'%'
-#define SPECIALS	"^$*+?.([%-"
-
-
 static int check_capture (MatchState *ms, int l) {
   l -= '1';
   if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED)
@@ -227,19 +385,23 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
+/*
+** returns the end of the single-char class at 'p', or NULL if the
+** class is malformed
+*/
+static const char *classend (const char *p, const char *p_end) {
   switch (*p++) {
     case L_ESC: {
-      if (p == ms->p_end)
-        luaL_error(ms->L, "malformed pattern (ends with " LUA_QL("%%") ")");
+      if (p == p_end)
+        return NULL;  /* pattern ends with '%' */
       return p+1;
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a `]' */
-        if (p == ms->p_end)
-          luaL_error(ms->L, "malformed pattern (missing " LUA_QL("]") ")");
-        if (*(p++) == L_ESC && p < ms->p_end)
+        if (p == p_end)
+          return NULL;  /* missing ']' */
+        if (*(p++) == L_ESC && p < p_end)
           p++;  /* skip escapes (e.g. `%]') */
       } while (*p != ']');
       return p+1;
@@ -304,24 +466,348 @@ static int singlematch (int c, const char *p, const char *ep) {
 }
 
 
-static const char *match (MatchState *ms, const char *s, const char *p);
+/*
+** fills 'cs' with all chars matched by the class [p, ep). Classes are
+** resolved with the locale in effect when the pattern is compiled.
+*/
+static void makeset (CharSet *cs, const char *p, const char *ep) {
+  int c;
+  memset(cs->b, 0, sizeof(cs->b));
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    if (singlematch(c, p, ep))
+      addset(cs, c);
+  }
+}
+
+
+/*
+** compiles pattern [p, p_end) into 'item' and 'set' and returns the
+** number of items; when 'item' is NULL, only counts items (returned)
+** and sets (in '*nsets')
+*/
+static int compile (const char *p, const char *p_end, PatItem *item,
+                    CharSet *set, int *nsets) {
+  int ni = 0;
+  int ns = 0;
+  PatItem dummy;
+  while (p < p_end) {
+    PatItem *it = (item != NULL) ? &item[ni] : &dummy;
+    const char *ep;
+    ni++;
+    it->rep = it->c1 = it->c2 = 0;
+    it->set = 0;
+    switch (*p) {
+      case '(': {  /* start capture */
+        if (*(p+1) == ')') {  /* position capture? */
+          it->op = PI_POSITION; p += 2;
+        }
+        else {
+          it->op = PI_OPEN; p++;
+        }
+        continue;
+      }
+      case ')': {  /* end capture */
+        it->op = PI_CLOSE; p++;
+        continue;
+      }
+      case '$': {
+        if ((p+1) == p_end) {  /* is the `$' the last char in pattern? */
+          it->op = PI_EOS; p++;
+          continue;
+        }
+        break;  /* else a plain char */
+      }
+      case L_ESC: {  /* escaped sequences not in the format class[*+?-]? */
+        switch (*(p+1)) {
+          case 'b': {  /* balanced string? */
+            if (p + 2 >= p_end - 1) {
+              it->op = PI_ERROR; it->c1 = PE_BALANCE;
+              p = p_end;  /* nothing after it can be reached */
+            }
+            else {
+              it->op = PI_BALANCE;
+              it->c1 = uchar(*(p+2)); it->c2 = uchar(*(p+3));
+              p += 4;
+            }
+            continue;
+          }
+          case 'f': {  /* frontier? */
+            p += 2;
+            if (*p != '[') {
+              it->op = PI_ERROR; it->c1 = PE_FRONTIER;
+              p = p_end;
+            }
+            else if ((ep = classend(p, p_end)) == NULL) {
+              it->op = PI_ERROR; it->c1 = PE_BRACKET;
+              p = p_end;
+            }
+            else {
+              it->op = PI_FRONTIER;
+              it->set = ns++;
+              if (item != NULL) makeset(&set[it->set], p, ep);
+              p = ep;
+            }
+            continue;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {  /* capture results (%0-%9)? */
+            it->op = PI_BACKREF; it->c1 = uchar(*(p+1));
+            p += 2;
+            continue;
+          }
+          default: break;
+        }
+        break;
+      }
+      default: break;
+    }
+    /* pattern class plus optional suffix */
+    if ((ep = classend(p, p_end)) == NULL) {
+      it->op = PI_ERROR;
+      it->c1 = (*p == L_ESC) ? PE_ESCEND : PE_BRACKET;
+      p = p_end;
+      continue;
+    }
+    if (*p == L_ESC || *p == '[' || *p == '.') {
+      it->op = PI_SET;
+      it->set = ns++;
+      if (item != NULL) makeset(&set[it->set], p, ep);
+    }
+    else {
+      it->op = PI_CHAR; it->c1 = uchar(*p);
+    }
+    switch (*ep) {
+      case '?': case '*': case '+': case '-': {
+        it->rep = uchar(*ep);
+        p = ep + 1;
+        break;
+      }
+      default: p = ep;
+    }
+  }
+  *nsets = ns;
+  return ni;
+}
+
+
+/*
+** collects the literal chars that start every match of 'pat'.
+** Position and capture openings are skipped, as they match the empty
+** string and can raise no error (as long as there are not too many
+** of them).
+*/
+static size_t getprefix (const Pattern *pat, char *prefix) {
+  size_t l = 0;
+  int nopen = 0;
+  int i;
+  for (i = 0; i < pat->nitems; i++) {
+    const PatItem *it = &patitems(pat)[i];
+    if (it->op == PI_OPEN || it->op == PI_POSITION) {
+      if (++nopen > LUA_MAXCAPTURES) break;
+    }
+    else if (it->op == PI_CHAR && it->rep == 0)
+      prefix[l++] = (char)it->c1;
+    else break;
+  }
+  return l;
+}
+
+
+/*
+** computes into 'cs' the set of chars that can start a match of the
+** pattern from item 'i' on. Returns 0 when there is no such set: the
+** pattern may match the empty string, or it may reach an item that has
+** side effects (such as raising an error) before consuming a char.
+*/
+static int getfirst (const Pattern *pat, int i, CharSet *cs) {
+  int nopen = 0;
+  for (; i < pat->nitems; i++) {
+    const PatItem *it = &patitems(pat)[i];
+    switch (it->op) {
+      case PI_OPEN: case PI_POSITION: {
+        if (++nopen > LUA_MAXCAPTURES) return 0;
+        break;  /* go on to next item */
+      }
+      case PI_CHAR: case PI_SET: {
+        if (it->op == PI_CHAR)
+          addset(cs, it->c1);
+        else {
+          size_t k;
+          for (k = 0; k < sizeof(cs->b); k++)
+            cs->b[k] |= patsets(pat)[it->set].b[k];
+        }
+        if (it->rep == 0 || it->rep == '+')
+          return 1;  /* item must match the first char */
+        break;  /* item is optional; next item can also start a match */
+      }
+      case PI_BALANCE: {
+        addset(cs, it->c1);
+        return 1;
+      }
+      default: return 0;
+    }
+  }
+  return 0;  /* pattern can match the empty string */
+}
+
+
+/*
+** sets the first-char information of 'pat', used to skip positions
+** where no match can start when the pattern has no literal prefix
+*/
+static void setfirst (Pattern *pat) {
+  int c;
+  memset(pat->first.b, 0, sizeof(pat->first.b));
+  pat->nfirst = -1;
+  if (pat->lprefix > 0 || !getfirst(pat, 0, &pat->first))
+    return;
+  pat->nfirst = 0;
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    if (testset(&pat->first, c)) {
+      if (pat->nfirst < (int)sizeof(pat->firstc))
+        pat->firstc[pat->nfirst] = (unsigned char)c;
+      pat->nfirst++;
+    }
+  }
+}
+
+
+/*
+** compiles pattern 'p' into a new userdata, which is left on the stack.
+** If 'caret' is true, a leading '^' anchors the pattern.
+*/
+static Pattern *newpattern (lua_State *L, const char *p, size_t lp,
+                            int caret) {
+  int anchor = (caret && *p == '^');
+  int ni, ns;
+  Pattern *pat;
+  if (anchor) {
+    p++; lp--;  /* skip anchor character */
+  }
+  ni = compile(p, p + lp, NULL, NULL, &ns);
+  pat = (Pattern *)lua_newuserdata(L, sizeof(Pattern) +
+                                      ni * sizeof(PatItem) +
+                                      ns * sizeof(CharSet) +
+                                      ni * sizeof(char));
+  pat->nitems = ni;
+  pat->nsets = ns;
+  compile(p, p + lp, patitems(pat), patsets(pat), &ns);
+  pat->anchor = anchor;
+  pat->lprefix = getprefix(pat, patprefix(pat));
+  setfirst(pat);
+  return pat;
+}
+
+
+/*
+** Cache of compiled patterns, indexed by the address of the pattern
+** string. Its uservalue is a table that keeps alive, for each slot,
+** the pattern string (so that its address cannot be reused by another
+** string) and the compiled pattern. Replacing that table flushes the
+** cache (see LUA_PATCACHEKEY).
+*/
+typedef struct PatCache {
+  struct {
+    const char *key;  /* address of pattern string */
+    int caret;  /* whether '^' is an anchor for this compilation */
+  } slot[LUA_PATCACHESIZE];
+} PatCache;
+
+
+/*
+** '__clone' for the cache: strings in a cloned state have other
+** addresses, so the copy starts empty
+*/
+static int patcache_clone (lua_State *L) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, 1);
+  memset(pc, 0, sizeof(PatCache));
+  lua_createtable(L, 2 * LUA_PATCACHESIZE, 0);
+  lua_setuservalue(L, 1);
+  return 0;
+}
+
+
+static void newpatcache (lua_State *L) {
+  PatCache *pc = (PatCache *)lua_newuserdata(L, sizeof(PatCache));
+  memset(pc, 0, sizeof(PatCache));
+  lua_createtable(L, 2 * LUA_PATCACHESIZE, 0);
+  lua_setuservalue(L, -2);
+  lua_createtable(L, 0, 1);  /* metatable for the cache */
+  lua_pushcfunction(L, patcache_clone);
+  lua_setfield(L, -2, "__clone");
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_PATCACHEKEY);
+}
+
+
+/*
+** gets the compiled form of the pattern string at index 'arg', using
+** the cache in the first upvalue. The compiled pattern is left on the
+** stack, so it stays alive while in use.
+*/
+static Pattern *getpattern (lua_State *L, int arg, int caret) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
+  Pattern *pat = NULL;
+  size_t lp;
+  const char *p = lua_tolstring(L, arg, &lp);
+  int h = (int)(((size_t)p / sizeof(void *)) & (LUA_PATCACHESIZE - 1));
+  lua_getuservalue(L, lua_upvalueindex(1));  /* cache table */
+  if (pc->slot[h].key == p && pc->slot[h].caret == caret) {
+    lua_rawgeti(L, -1, 2 * h + 2);  /* hit; push compiled pattern */
+    pat = (Pattern *)lua_touserdata(L, -1);
+    if (pat == NULL)  /* cache was flushed? */
+      lua_pop(L, 1);
+  }
+  if (pat == NULL) {
+    pat = newpattern(L, p, lp, caret);
+    lua_pushvalue(L, arg);
+    lua_rawseti(L, -3, 2 * h + 1);  /* anchor pattern string */
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, 2 * h + 2);  /* store compiled pattern */
+    pc->slot[h].key = p;
+    pc->slot[h].caret = caret;
+  }
+  lua_remove(L, -2);  /* remove cache table */
+  return pat;
+}
+
+
+static void initmatch (MatchState *ms, lua_State *L, const char *s,
+                       size_t ls, const Pattern *pat) {
+  ms->L = L;
+  ms->src_init = s;
+  ms->src_end = s + ls;
+  ms->pat = pat;
+  ms->p_end = patitems(pat) + pat->nitems;
+  ms->set = patsets(pat);
+}
+
+
+static int itemmatch (MatchState *ms, int c, const PatItem *p) {
+  if (p->op == PI_CHAR)
+    return (c == p->c1);
+  else
+    return testset(&ms->set[p->set], c) != 0;
+}
+
+
+static const char *match (MatchState *ms, const char *s, const PatItem *p);
 
 
 static const char *matchbalance (MatchState *ms, const char *s,
-                                   const char *p) {
-  if (p >= ms->p_end - 1)
-    luaL_error(ms->L, "malformed pattern "
-                      "(missing arguments to " LUA_QL("%%b") ")");
-  if (*s != *p) return NULL;
+                                   const PatItem *p) {
+  if (uchar(*s) != p->c1) return NULL;
   else {
-    int b = *p;
-    int e = *(p+1);
+    int b = p->c1;
+    int e = p->c2;
     int cont = 1;
     while (++s < ms->src_end) {
-      if (*s == e) {
+      if (uchar(*s) == e) {
         if (--cont == 0) return s+1;
       }
-      else if (*s == b) cont++;
+      else if (uchar(*s) == b) cont++;
     }
   }
   return NULL;  /* string ends out of balance */
@@ -329,13 +815,13 @@ static const char *matchbalance (MatchState *ms, const char *s,
 
 
 static const char *max_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+                                 const PatItem *p) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
-  while ((s+i)<ms->src_end && singlematch(uchar(*(s+i)), p, ep))
+  while ((s+i)<ms->src_end && itemmatch(ms, uchar(*(s+i)), p))
     i++;
   /* keeps trying to match with the maximum repetitions */
   while (i>=0) {
-    const char *res = match(ms, (s+i), ep+1);
+    const char *res = match(ms, (s+i), p+1);
     if (res) return res;
     i--;  /* else didn't match; reduce 1 repetition to try again */
   }
@@ -344,12 +830,12 @@ static const char *max_expand (MatchState *ms, const char *s,
 
 
 static const char *min_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+                                 const PatItem *p) {
   for (;;) {
-    const char *res = match(ms, s, ep+1);
+    const char *res = match(ms, s, p+1);
     if (res != NULL)
       return res;
-    else if (s<ms->src_end && singlematch(uchar(*s), p, ep))
+    else if (s<ms->src_end && itemmatch(ms, uchar(*s), p))
       s++;  /* try with one more repetition */
     else return NULL;
   }
@@ -357,7 +843,7 @@ static const char *min_expand (MatchState *ms, const char *s,
 
 
 static const char *start_capture (MatchState *ms, const char *s,
-                                    const char *p, int what) {
+                                    const PatItem *p, int what) {
   const char *res;
   int level = ms->level;
   if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
@@ -371,7 +857,7 @@ static const char *start_capture (MatchState *ms, const char *s,
 
 
 static const char *end_capture (MatchState *ms, const char *s,
-                                  const char *p) {
+                                  const PatItem *p) {
   int l = capture_to_close(ms);
   const char *res;
   ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
@@ -392,76 +878,64 @@ static const char *match_capture (MatchState *ms, const char *s, int l) {
 }
 
 
-static const char *match (MatchState *ms, const char *s, const char *p) {
+static const char *match (MatchState *ms, const char *s, const PatItem *p) {
   init: /* using goto's to optimize tail recursion */
   if (p == ms->p_end)  /* end of pattern? */
     return s;  /* match succeeded */
-  switch (*p) {
-    case '(': {  /* start capture */
-      if (*(p+1) == ')')  /* position capture? */
-        return start_capture(ms, s, p+2, CAP_POSITION);
-      else
-        return start_capture(ms, s, p+1, CAP_UNFINISHED);
+  switch (p->op) {
+    case PI_OPEN: {  /* start capture */
+      return start_capture(ms, s, p+1, CAP_UNFINISHED);
     }
-    case ')': {  /* end capture */
+    case PI_POSITION: {  /* position capture */
+      return start_capture(ms, s, p+1, CAP_POSITION);
+    }
+    case PI_CLOSE: {  /* end capture */
       return end_capture(ms, s, p+1);
     }
-    case '$': {
-      if ((p+1) == ms->p_end)  /* is the `$' the last char in pattern? */
-        return (s == ms->src_end) ? s : NULL;  /* check end of string */
-      else goto dflt;
-    }
-    case L_ESC: {  /* escaped sequences not in the format class[*+?-]? */
-      switch (*(p+1)) {
-        case 'b': {  /* balanced string? */
-          s = matchbalance(ms, s, p+2);
-          if (s == NULL) return NULL;
-          p+=4; goto init;  /* else return match(ms, s, p+4); */
-        }
-        case 'f': {  /* frontier? */
-          const char *ep; char previous;
-          p += 2;
-          if (*p != '[')
-            luaL_error(ms->L, "missing " LUA_QL("[") " after "
-                               LUA_QL("%%f") " in pattern");
-          ep = classend(ms, p);  /* points to what is next */
-          previous = (s == ms->src_init) ? '\0' : *(s-1);
-          if (matchbracketclass(uchar(previous), p, ep-1) ||
-             !matchbracketclass(uchar(*s), p, ep-1)) return NULL;
-          p=ep; goto init;  /* else return match(ms, s, ep); */
-        }
-        case '0': case '1': case '2': case '3':
-        case '4': case '5': case '6': case '7':
-        case '8': case '9': {  /* capture results (%0-%9)? */
-          s = match_capture(ms, s, uchar(*(p+1)));
-          if (s == NULL) return NULL;
-          p+=2; goto init;  /* else return match(ms, s, p+2) */
-        }
-        default: goto dflt;
-      }
+    case PI_EOS: {  /* end of subject? */
+      return (s == ms->src_end) ? s : NULL;
+    }
+    case PI_BALANCE: {  /* balanced string? */
+      s = matchbalance(ms, s, p);
+      if (s == NULL) return NULL;
+      p++; goto init;  /* else return match(ms, s, p+1); */
+    }
+    case PI_FRONTIER: {  /* frontier? */
+      const CharSet *cs = &ms->set[p->set];
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s-1));
+      if (testset(cs, previous) || !testset(cs, uchar(*s))) return NULL;
+      p++; goto init;  /* else return match(ms, s, p+1); */
+    }
+    case PI_BACKREF: {  /* capture results (%0-%9)? */
+      s = match_capture(ms, s, p->c1);
+      if (s == NULL) return NULL;
+      p++; goto init;  /* else return match(ms, s, p+1) */
+    }
+    case PI_ERROR: {  /* malformed pattern */
+      luaL_error(ms->L, "%s", patterrors[p->c1]);
+      return NULL;  /* not reached */
     }
-    default: dflt: {  /* pattern class plus optional suffix */
-      const char *ep = classend(ms, p);  /* points to what is next */
-      int m = s < ms->src_end && singlematch(uchar(*s), p, ep);
-      switch (*ep) {
+    default: {  /* pattern class plus optional suffix */
+      int m = s < ms->src_end && itemmatch(ms, uchar(*s), p);
+      switch (p->rep) {
         case '?': {  /* optional */
           const char *res;
-          if (m && ((res=match(ms, s+1, ep+1)) != NULL))
+          if (m && ((res=match(ms, s+1, p+1)) != NULL))
             return res;
-          p=ep+1; goto init;  /* else return match(ms, s, ep+1); */
+          p++; goto init;  /* else return match(ms, s, p+1); */
         }
         case '*': {  /* 0 or more repetitions */
-          return max_expand(ms, s, p, ep);
+          return max_expand(ms, s, p);
         }
         case '+': {  /* 1 or more repetitions */
-          return (m ? max_expand(ms, s+1, p, ep) : NULL);
+          return (m ? max_expand(ms, s+1, p) : NULL);
         }
         case '-': {  /* 0 or more repetitions (minimum) */
-          return min_expand(ms, s, p, ep);
+          return min_expand(ms, s, p);
         }
         default: {
           if (!m) return NULL;
-          s++; p=ep; goto init;  /* else return match(ms, s+1, ep); */
+          s++; p++; goto init;  /* else return match(ms, s+1, p+1); */
         }
       }
     }
@@ -469,6 +943,42 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 }
 
 
+#if defined(LUA_USE_SSE2)
+/*
+** Vectorized search for needles with at least 2 chars: compares 16
+** candidate positions at a time against both the first and the last
+** char of 's2', and only calls 'memcmp' for positions where both
+** match. This filters out most false candidates that a 'memchr' on
+** the first char alone would report in repetitive texts. Returns the
+** position where the (shorter) scalar search must go on when no match
+** is found in the vectorized part.
+*/
+static const char *simdfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2,
+                               const char **found) {
+  const __m128i first = _mm_set1_epi8(s2[0]);
+  const __m128i last = _mm_set1_epi8(s2[l2 - 1]);
+  const char *lim = s1 + (l1 - l2 + 1);  /* candidates are below 'lim' */
+  *found = NULL;
+  while (lim - s1 >= 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)s1);
+    __m128i bl = _mm_loadu_si128((const __m128i *)(s1 + l2 - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+    while (mask != 0) {
+      int i = __builtin_ctz(mask);
+      if (memcmp(s1 + i + 1, s2 + 1, l2 - 2) == 0) {
+        *found = s1 + i;
+        return s1;
+      }
+      mask &= mask - 1;  /* clear lowest set bit */
+    }
+    s1 += 16;
+  }
+  return s1;
+}
+#endif
+
 
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
@@ -476,11 +986,21 @@ static const char *lmemfind (const char *s1, size_t l1,
   else if (l2 > l1) return NULL;  /* avoids a negative `l1' */
   else {
     const char *init;  /* to search for a `*s2' inside `s1' */
+#if defined(LUA_USE_SSE2)
+    if (l2 >= 2) {
+      const char *found;
+      const char *rest = simdfind(s1, l1, s2, l2, &found);
+      if (found != NULL) return found;
+      l1 -= rest - s1;  /* search what is left in the scalar loop */
+      s1 = rest;
+    }
+#endif
     l2--;  /* 1st char will be checked by `memchr' */
     l1 = l1-l2;  /* `s2' cannot be found after that */
     while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
       init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
+      if (init[l2 - 1] == s2[l2] &&  /* check last char first */
+          memcmp(init, s2+1, l2) == 0)
         return init-1;
       else {  /* correct `l1' and `s1' to try again */
         l1 -= init-s1;
@@ -492,6 +1012,47 @@ static const char *lmemfind (const char *s1, size_t l1,
 }
 
 
+/*
+** returns the first position not before 's' where a match of the
+** pattern may start, or NULL if there is none
+*/
+static const char *nextcandidate (MatchState *ms, const char *s) {
+  const Pattern *pat = ms->pat;
+  const char *e = ms->src_end;
+  if (pat->lprefix > 0)  /* every match starts with a literal? */
+    return lmemfind(s, e - s, patprefix(pat), pat->lprefix);
+  else if (pat->nfirst < 0)  /* a match can start anywhere? */
+    return s;
+  else if (pat->nfirst == 0)  /* no char can start a match? */
+    return NULL;
+  else if (pat->nfirst == 1)
+    return (const char *)memchr(s, pat->firstc[0], e - s);
+#if defined(LUA_USE_SSE2)
+  else if (pat->nfirst <= (int)sizeof(pat->firstc)) {
+    /* compare 16 chars at a time against each possible first char */
+    __m128i c[sizeof(pat->firstc)];
+    int i;
+    for (i = 0; i < (int)sizeof(pat->firstc); i++)  /* repeat last char */
+      c[i] = _mm_set1_epi8(pat->firstc[i < pat->nfirst ? i : pat->nfirst - 1]);
+    for (; e - s >= 16; s += 16) {
+      __m128i b = _mm_loadu_si128((const __m128i *)s);
+      __m128i m = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(b, c[0]), _mm_cmpeq_epi8(b, c[1])),
+          _mm_or_si128(_mm_cmpeq_epi8(b, c[2]), _mm_cmpeq_epi8(b, c[3])));
+      int mask = _mm_movemask_epi8(m);
+      if (mask != 0)
+        return s + __builtin_ctz((unsigned int)mask);
+    }
+  }
+#endif
+  for (; s < e; s++) {
+    if (testset(&pat->first, uchar(*s)))
+      return s;
+  }
+  return NULL;  /* no char can start a match */
+}
+
+
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
@@ -556,18 +1117,14 @@ static int str_find_aux (lua_State *L, int find) {
   else {
     MatchState ms;
     const char *s1 = s + init - 1;
-    int anchor = (*p == '^');
-    if (anchor) {
-      p++; lp--;  /* skip anchor character */
-    }
-    ms.L = L;
-    ms.src_init = s;
-    ms.src_end = s + ls;
-    ms.p_end = p + lp;
+    const Pattern *pat = getpattern(L, 2, 1);
+    initmatch(&ms, L, s, ls, pat);
     do {
       const char *res;
+      if (!pat->anchor && (s1 = nextcandidate(&ms, s1)) == NULL)
+        break;  /* no more candidate positions */
       ms.level = 0;
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=match(&ms, s1, patitems(pat))) != NULL) {
         if (find) {
           lua_pushinteger(L, s1 - s + 1);  /* start */
           lua_pushinteger(L, res - s);   /* end */
@@ -576,7 +1133,7 @@ static int str_find_aux (lua_State *L, int find) {
         else
           return push_captures(&ms, s1, res);
       }
-    } while (s1++ < ms.src_end && !anchor);
+    } while (s1++ < ms.src_end && !pat->anchor);
   }
   lua_pushnil(L);  /* not found */
   return 1;
@@ -595,20 +1152,19 @@ static int str_match (lua_State *L) {
 
 static int gmatch_aux (lua_State *L) {
   MatchState ms;
-  size_t ls, lp;
+  size_t ls;
   const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
-  const char *p = lua_tolstring(L, lua_upvalueindex(2), &lp);
+  const Pattern *pat = (const Pattern *)lua_touserdata(L, lua_upvalueindex(2));
   const char *src;
-  ms.L = L;
-  ms.src_init = s;
-  ms.src_end = s+ls;
-  ms.p_end = p + lp;
+  initmatch(&ms, L, s, ls, pat);
   for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
        src <= ms.src_end;
        src++) {
     const char *e;
+    if ((src = nextcandidate(&ms, src)) == NULL)
+      break;  /* no more candidate positions */
     ms.level = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
+    if ((e = match(&ms, src, patitems(pat))) != NULL) {
       lua_Integer newstart = e-s;
       if (e == src) newstart++;  /* empty match? go at least one position */
       lua_pushinteger(L, newstart);
@@ -624,6 +1180,8 @@ static int gmatch (lua_State *L) {
   luaL_checkstring(L, 1);
   luaL_checkstring(L, 2);
   lua_settop(L, 2);
+  getpattern(L, 2, 0);  /* in 'gmatch', a leading '^' is a plain char */
+  lua_replace(L, 2);  /* iterator keeps the compiled pattern */
   lua_pushinteger(L, 0);
   lua_pushcclosure(L, gmatch_aux, 3);
   return 1;
@@ -688,30 +1246,31 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
 
 
 static int str_gsub (lua_State *L) {
-  size_t srcl, lp;
+  size_t srcl;
   const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checklstring(L, 2, &lp);
   int tr = lua_type(L, 3);
   size_t max_s = luaL_optinteger(L, 4, srcl+1);
-  int anchor = (*p == '^');
   size_t n = 0;
+  const Pattern *pat;
   MatchState ms;
   luaL_Buffer b;
+  luaL_checkstring(L, 2);
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
+  pat = getpattern(L, 2, 1);  /* (must be below the buffer) */
   luaL_buffinit(L, &b);
-  if (anchor) {
-    p++; lp--;  /* skip anchor character */
-  }
-  ms.L = L;
-  ms.src_init = src;
-  ms.src_end = src+srcl;
-  ms.p_end = p + lp;
+  initmatch(&ms, L, src, srcl, pat);
   while (n < max_s) {
     const char *e;
+    if (!pat->anchor) {  /* skip positions where no match can start */
+      const char *c = nextcandidate(&ms, src);
+      if (c == NULL) break;
+      luaL_addlstring(&b, src, c - src);
+      src = c;
+    }
     ms.level = 0;
-    e = match(&ms, src, p);
+    e = match(&ms, src, patitems(pat));
     if (e) {
       n++;
       add_value(&ms, &b, src, e, tr);
@@ -721,7 +1280,7 @@ static int str_gsub (lua_State *L) {
     else if (src < ms.src_end)
       luaL_addchar(&b, *src++);
     else break;
-    if (anchor) break;
+    if (pat->anchor) break;
   }
   luaL_addlstring(&b, src, ms.src_end-src);
   luaL_pushresult(&b);
@@ -842,22 +1401,61 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
-static int str_format (lua_State *L) {
+/*
+** returns the precision of a plain '%g' format (one without flags or
+** width), or -1 if 'form' is not such a format
+*/
+static int plainprec (const char *form) {
+  int prec = 6;  /* default precision */
+  form++;  /* skip '%' */
+  if (*form == '.') {
+    prec = 0;
+    while (isdigit(uchar(*++form)))
+      prec = prec * 10 + (*form - '0');
+  }
+  return (form[0] == 'g' && form[1] == '\0') ? prec : -1;
+}
+
+
+/*
+** converts 'ni' as a plain '%d' format would do
+*/
+static int writeint (char *buff, LUA_INTFRM_T ni) {
+  unsigned LUA_INTFRM_T u = (unsigned LUA_INTFRM_T)ni;
+  char tmp[3 * sizeof(LUA_INTFRM_T) + 1];
+  int n = 0;
+  int l = 0;
+  if (ni < 0) {
+    u = 0u - u;  /* absolute value */
+    buff[l++] = '-';
+  }
+  do {
+    tmp[n++] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  while (n > 0) buff[l++] = tmp[--n];
+  return l;
+}
+
+
+/*
+** format the values following the format string at index 'arg' into
+** buffer 'b' (which is initialized here); does not push the result
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg) {
   int top = lua_gettop(L);
-  int arg = 1;
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
+  luaL_buffinit(L, b);
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+      luaL_addchar(b, *strfrmt++);
     else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+      luaL_addchar(b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format (`%...') */
-      char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
+      char *buff = luaL_prepbuffsize(b, MAX_ITEM);  /* to put formatted item */
       int nb = 0;  /* number of bytes in added item */
       if (++arg > top)
         luaL_argerror(L, arg, "no value");
@@ -873,8 +1471,12 @@ static int str_format (lua_State *L) {
           lua_Number diff = n - (lua_Number)ni;
           luaL_argcheck(L, -1 < diff && diff < 1, arg,
                         "not a number in proper range");
-          addlenmod(form, LUA_INTFRMLEN);
-          nb = sprintf(buff, form, ni);
+          if (form[2] == '\0')  /* plain '%d'? */
+            nb = writeint(buff, ni);
+          else {
+            addlenmod(form, LUA_INTFRMLEN);
+            nb = sprintf(buff, form, ni);
+          }
           break;
         }
         case 'o':  case 'u':  case 'x':  case 'X': {
@@ -892,12 +1494,17 @@ static int str_format (lua_State *L) {
         case 'a': case 'A':
 #endif
         case 'g': case 'G': {
-          addlenmod(form, LUA_FLTFRMLEN);
-          nb = sprintf(buff, form, (LUA_FLTFRM_T)luaL_checknumber(L, arg));
+          int prec = plainprec(form);
+          if (prec >= 0)
+            nb = lua_fmtnumber(L, buff, luaL_checknumber(L, arg), prec);
+          else {
+            addlenmod(form, LUA_FLTFRMLEN);
+            nb = sprintf(buff, form, (LUA_FLTFRM_T)luaL_checknumber(L, arg));
+          }
           break;
         }
         case 'q': {
-          addquoted(L, &b, arg);
+          addquoted(L, b, arg);
           break;
         }
         case 's': {
@@ -906,7 +1513,7 @@ static int str_format (lua_State *L) {
           if (!strchr(form, '.') && l >= 100) {
             /* no precision and string is too long to be formatted;
                keep original string */
-            luaL_addvalue(&b);
+            luaL_addvalue(b);
             break;
           }
           else {
@@ -916,13 +1523,19 @@ static int str_format (lua_State *L) {
           }
         }
         default: {  /* also treat cases `pnLlh' */
-          return luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
-                               LUA_QL("format"), *(strfrmt - 1));
+          luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
+                        LUA_QL("format"), *(strfrmt - 1));
         }
       }
-      luaL_addsize(&b, nb);
+      luaL_addsize(b, nb);
     }
   }
+}
+
+
+static int str_format (lua_State *L) {
+  luaL_Buffer b;
+  addformat(L, &b, 1);
   luaL_pushresult(&b);
   return 1;
 }
@@ -930,17 +1543,199 @@ static int str_format (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** STRING BUFFER
+** =======================================================
+*/
+
+#define LUA_STRBUFHANDLE	"string.buffer"
+
+
+/*
+** a growable character buffer kept outside the Lua stack, so that it
+** can be reused across calls; its contents are only turned into a Lua
+** string by 'tostring'. The characters live in a plain userdata (the
+** box) stored at index 1 of the buffer's uservalue table, so they are
+** allocated and accounted by the collector like any other object and
+** the buffer itself holds no pointers.
+*/
+typedef struct StrBuf {
+  size_t size;  /* box size (capacity) */
+  size_t n;  /* number of characters in buffer */
+} StrBuf;
+
+
+#define tostrbuf(L)	((StrBuf *)luaL_checkudata(L, 1, LUA_STRBUFHANDLE))
+
+
+/*
+** pushes the box of the buffer at index 'idx' and returns its address
+** (NULL if no box was allocated yet)
+*/
+static char *strbuf_box (lua_State *L, int idx) {
+  lua_getuservalue(L, idx);
+  lua_rawgeti(L, -1, 1);
+  lua_remove(L, -2);  /* remove uservalue table */
+  return (char *)lua_touserdata(L, -1);
+}
+
+
+/*
+** returns a pointer to a free area with at least 'sz' bytes; the area
+** stays valid while the buffer at 'idx' is alive and not grown again
+*/
+static char *strbuf_prep (lua_State *L, int idx, StrBuf *sb, size_t sz) {
+  char *b;
+  idx = lua_absindex(L, idx);
+  b = strbuf_box(L, idx);
+  if (sb->size - sb->n < sz) {  /* not enough space? */
+    char *newbox;
+    size_t newsize = sb->size * 2;  /* double buffer size */
+    if (newsize < LUAL_BUFFERSIZE)
+      newsize = LUAL_BUFFERSIZE;
+    if (newsize - sb->n < sz)  /* not big enough? */
+      newsize = sb->n + sz;
+    if (newsize < sb->n || newsize - sb->n < sz)
+      luaL_error(L, "buffer too large");
+    newbox = (char *)lua_newuserdata(L, newsize * sizeof(char));
+    if (sb->n > 0)
+      memcpy(newbox, b, sb->n * sizeof(char));
+    lua_getuservalue(L, idx);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, 1);  /* uservalue[1] = newbox */
+    lua_pop(L, 2);  /* pop uservalue table and new box */
+    b = newbox;
+    sb->size = newsize;
+  }
+  lua_pop(L, 1);  /* pop old box */
+  return b + sb->n;
+}
+
+
+static void strbuf_addlstring (lua_State *L, int idx, StrBuf *sb,
+                                         const char *s, size_t l) {
+  if (l > 0) {  /* avoid touching an unallocated buffer */
+    memcpy(strbuf_prep(L, idx, sb, l), s, l * sizeof(char));
+    sb->n += l;
+  }
+}
+
+
+static int strbuf_new (lua_State *L) {
+  lua_Integer sz = luaL_optinteger(L, 1, 0);
+  StrBuf *sb = (StrBuf *)lua_newuserdata(L, sizeof(StrBuf));
+  sb->size = sb->n = 0;  /* buffer is in a consistent state */
+  luaL_setmetatable(L, LUA_STRBUFHANDLE);
+  lua_createtable(L, 1, 0);  /* table to hold the box */
+  lua_setuservalue(L, -2);
+  if (sz > 0)  /* preallocate requested capacity */
+    strbuf_prep(L, -1, sb, (size_t)sz);
+  return 1;
+}
+
+
+/*
+** appends each argument; numbers are converted directly into the
+** buffer, so no intermediate strings are created
+*/
+static int strbuf_append (lua_State *L) {
+  StrBuf *sb = tostrbuf(L);
+  int n = lua_gettop(L);
+  int i;
+  for (i = 2; i <= n; i++) {
+    if (lua_type(L, i) == LUA_TNUMBER) {
+      char *p = strbuf_prep(L, 1, sb, LUAI_MAXNUMBER2STR);
+      sb->n += lua_fmtnumber(L, p, lua_tonumber(L, i), -1);
+    }
+    else {
+      size_t l;
+      const char *s = luaL_checklstring(L, i, &l);
+      strbuf_addlstring(L, 1, sb, s, l);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;  /* return buffer itself, to allow chaining */
+}
+
+
+static int strbuf_appendf (lua_State *L) {
+  StrBuf *sb = tostrbuf(L);
+  luaL_Buffer b;
+  addformat(L, &b, 2);
+  strbuf_addlstring(L, 1, sb, b.b, b.n);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int strbuf_reset (lua_State *L) {
+  StrBuf *sb = tostrbuf(L);
+  sb->n = 0;  /* keep allocated space for reuse */
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int strbuf_tostring (lua_State *L) {
+  StrBuf *sb = tostrbuf(L);
+  lua_pushlstring(L, strbuf_box(L, 1), sb->n);
+  return 1;
+}
+
+
+static int strbuf_size (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)tostrbuf(L)->n);
+  return 1;
+}
+
+
+static int strbuf_capacity (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)tostrbuf(L)->size);
+  return 1;
+}
+
+
+static const luaL_Reg strbuflib[] = {
+  {"append", strbuf_append},
+  {"appendf", strbuf_appendf},
+  {"capacity", strbuf_capacity},
+  {"reset", strbuf_reset},
+  {"size", strbuf_size},
+  {"tostring", strbuf_tostring},
+  {"__len", strbuf_size},
+  {"__tostring", strbuf_tostring},
+  {NULL, NULL}
+};
+
+
+static void createbufmeta (lua_State *L) {
+  luaL_newmetatable(L, LUA_STRBUFHANDLE);  /* metatable for buffers */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, strbuflib, 0);  /* add buffer methods to metatable */
+  lua_pushboolean(L, 1);  /* buffers hold no addresses... */
+  lua_setfield(L, -2, "__clone");  /* ...so clones can copy them as they are */
+  lua_pop(L, 1);  /* pop metatable */
+}
+
+/* }====================================================== */
+
+
 static const luaL_Reg strlib[] = {
-  {"byte", str_byte},
-  {"char", str_char},
+  {"buffer", strbuf_new},
   {"dump", str_dump},
-  {"find", str_find},
   {"format", str_format},
-  {"gmatch", gmatch},
-  {"gsub", str_gsub},
+  {NULL, NULL}
+};
+
+
+/* functions that neither yield nor call Lua (see 'luaL_setleaffuncs') */
+static const luaL_Reg leaflib[] = {
+  {"byte", str_byte},
+  {"char", str_char},
   {"len", str_len},
   {"lower", str_lower},
-  {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
   {"sub", str_sub},
@@ -949,6 +1744,16 @@ static const luaL_Reg strlib[] = {
 };
 
 
+/* functions that share the pattern cache as their upvalue */
+static const luaL_Reg patlib[] = {
+  {"find", str_find},
+  {"gmatch", gmatch},
+  {"gsub", str_gsub},
+  {"match", str_match},
+  {NULL, NULL}
+};
+
+
 static void createmetatable (lua_State *L) {
   lua_createtable(L, 0, 1);  /* table to be metatable for strings */
   lua_pushliteral(L, "");  /* dummy string */
@@ -965,8 +1770,13 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
-  luaL_newlib(L, strlib);
+  luaL_newlibtable(L, leaflib);
+  luaL_setleaffuncs(L, leaflib);
+  luaL_setfuncs(L, strlib, 0);
+  newpatcache(L);
+  luaL_setfuncs(L, patlib, 1);
   createmetatable(L);
+  createbufmeta(L);
   return 1;
 }
 
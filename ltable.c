@@ -113,7 +113,7 @@ static Node *mainposition (const Table *t, const TValue *key) {
       return hashboolean(t, bvalue(key));
     case LUA_TLIGHTUSERDATA:
       return hashpointer(t, pvalue(key));
-    case LUA_TLCF:
+    case LUA_TLCF: case LUA_TLLF:
       return hashpointer(t, fvalue(key));
     default:
       return hashpointer(t, gcvalue(key));
@@ -636,12 +636,14 @@ int luaH_getn (Table *t) {
 
 
 
+int luaH_isdummy (Node *n) { return isdummy(n); }
+
+
+
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
   return mainposition(t, key);
 }
 
-int luaH_isdummy (Node *n) { return isdummy(n); }
-
 #endif
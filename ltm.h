@@ -51,6 +51,11 @@ typedef enum {
 // ȡete meta metdod(߽tag method)
 #define fasttm(l,et,e)	gfasttm(G(l), et, e)
 
+/* like 'gfasttm', but never writes the cache in 'flags' (so it can be
+** used by concurrent readers); returns a nil object when absent */
+#define gfasttmro(g,et,e) ((et) == NULL ? NULL : \
+  ((et)->flags & (1u<<(e))) ? NULL : luaH_getstr(et, (g)->tmname[e]))
+
 // xtypeĳ(lua.h)
 #define ttypename(x)	luaT_typenames_[(x) + 1]
 #define objtypename(x)	ttypename(ttypenv(x))
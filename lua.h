@@ -97,7 +97,8 @@ typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 /* predefined values in the registry */
 #define LUA_RIDX_MAINTHREAD	1
 #define LUA_RIDX_GLOBALS	2
-#define LUA_RIDX_LAST		LUA_RIDX_GLOBALS
+#define LUA_RIDX_SELECT	3	/* base library 'select', known to the VM */
+#define LUA_RIDX_LAST		LUA_RIDX_SELECT
 
 
 /* type of numbers in Lua */
@@ -125,6 +126,8 @@ typedef LUA_UNSIGNED lua_Unsigned;
 ** state manipulation
 */
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
+LUA_API lua_State *(lua_newarena) (lua_Alloc f, void *ud);
+LUA_API lua_State *(lua_clonestate) (lua_State *from, lua_Alloc f, void *ud);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
 
@@ -208,6 +211,7 @@ LUA_API const char *(lua_pushvfstring) (lua_State *L, const char *fmt,
                                                       va_list argp);
 LUA_API const char *(lua_pushfstring) (lua_State *L, const char *fmt, ...);
 LUA_API void  (lua_pushcclosure) (lua_State *L, lua_CFunction fn, int n);
+LUA_API void  (lua_pushleaffunction) (lua_State *L, lua_CFunction fn);
 LUA_API void  (lua_pushboolean) (lua_State *L, int b);
 LUA_API void  (lua_pushlightuserdata) (lua_State *L, void *p);
 LUA_API int   (lua_pushthread) (lua_State *L);
@@ -286,10 +290,38 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCISRUNNING		9
 #define LUA_GCGEN		10
 #define LUA_GCINC		11
+#define LUA_GCSETMARKERS	12
+#define LUA_GCSETBGFREE		13	/* host only: allocator must be thread safe */
+#define LUA_GCSETSTEPTIME	14
+#define LUA_GCSETCPUFRAC	15
+#define LUA_GCSETMINORMUL	16
+#define LUA_GCSETLIMIT		17
+#define LUA_GCSETTHREADPOOL	18
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 
+/*
+** statistics of the garbage collector; times are in seconds
+*/
+typedef struct lua_GCStats {
+  size_t cycles;  /* number of complete collection cycles */
+  size_t pauses;  /* number of times the collector ran */
+  double pausetime;  /* total time of those runs */
+  double maxpause;  /* longest run */
+  size_t swept;  /* bytes freed by the sweep phases */
+  double propagatetime;  /* time spent in each state... */
+  double atomictime;
+  double sweepstringtime;
+  double sweepudatatime;
+  double sweeptime;
+  size_t objects[LUA_NUMTAGS + 2];  /* live objects by type (plus
+                                       prototypes and upvalues) */
+} lua_GCStats;
+
+LUA_API void (lua_getgcstats) (lua_State *L, lua_GCStats *s);
+
+
 /*
 ** miscellaneous functions
 */
@@ -301,6 +333,17 @@ LUA_API int   (lua_next) (lua_State *L, int idx);
 LUA_API void  (lua_concat) (lua_State *L, int n);
 LUA_API void  (lua_len)    (lua_State *L, int idx);
 
+LUA_API int   (lua_fmtnumber) (lua_State *L, char *buff, lua_Number n,
+                                             int prec);
+
+/*
+** string collation modes (for string ordering with '<' and '<=')
+*/
+#define LUA_COLLLOCALE	0	/* 'strcoll' (current C locale) */
+#define LUA_COLLBYTES	1	/* plain byte order ('memcmp') */
+
+LUA_API int   (lua_setcollation) (lua_State *L, int mode);
+
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
 
@@ -391,6 +434,9 @@ LUA_API lua_Hook (lua_gethook) (lua_State *L);
 LUA_API int (lua_gethookmask) (lua_State *L);
 LUA_API int (lua_gethookcount) (lua_State *L);
 
+LUA_API int (lua_setallocprof) (lua_State *L, int rate);
+LUA_API int (lua_dumpallocprof) (lua_State *L, lua_Writer writer, void *data);
+
 
 struct lua_Debug {
   int event;
@@ -1,6 +1,7 @@
 // lua.hpp
 // Lua header files for C++
 // <<extern "C">> not supplied automatically because Lua also compiles as C++
+// (in that case LUA_API already gives the API C linkage)
 
 extern "C" {
 #include "lua.h"
@@ -47,6 +47,9 @@
 #define LUA_USE_STRTODHEX	/* assume 'strtod' handles hexa formats */
 #define LUA_USE_AFORMAT		/* assume 'printf' handles 'aA' specifiers */
 #define LUA_USE_LONGLONG	/* assume support for long long */
+#define LUA_USE_PTHREADS	/* needs an extra library: -lpthread */
+#define LUA_USE_SLAB		/* assume 'mmap' can reserve address space */
+#define LUA_USE_MMAPSTACK	/* big stacks get their own mappings */
 #endif
 
 #if defined(LUA_USE_MACOSX)
@@ -56,6 +59,8 @@
 #define LUA_USE_STRTODHEX	/* assume 'strtod' handles hexa formats */
 #define LUA_USE_AFORMAT		/* assume 'printf' handles 'aA' specifiers */
 #define LUA_USE_LONGLONG	/* assume support for long long */
+#define LUA_USE_SLAB		/* assume 'mmap' can reserve address space */
+#define LUA_USE_MMAPSTACK	/* big stacks get their own mappings */
 #endif
 
 
@@ -74,6 +79,16 @@
 #endif
 
 
+/*
+@@ LUA_USE_SSE2 enables SSE2 kernels in the string library.
+** CHANGE it (undefine it) if your compiler targets SSE2 but you do
+** not want Lua to use its intrinsics.
+*/
+#if !defined(LUA_ANSI) && defined(__GNUC__) && defined(__SSE2__)
+#define LUA_USE_SSE2
+#endif
+
+
 
 /*
 @@ LUA_PATH_DEFAULT is the default path that Lua uses to look for
@@ -148,6 +163,11 @@
 #define LUA_API __declspec(dllimport)
 #endif						/* } */
 
+#elif defined(__cplusplus)	/* }{ */
+
+/* keep C names when Lua is compiled as C++, so lua.hpp links either way */
+#define LUA_API		extern "C"
+
 #else				/* }{ */
 
 #define LUA_API		extern
@@ -404,6 +424,16 @@
 #define lua_number2str(s,n)	sprintf((s), LUA_NUMBER_FMT, (n))
 #define LUAI_MAXNUMBER2STR	32 /* 16 digits, sign, point, and \0 */
 
+/*
+@@ LUA_NUMBER_FMTPREC is the precision of LUA_NUMBER_FMT, which must be
+@* a '%g' format when it is defined. It enables a fast path that avoids
+@* 'sprintf' when converting most numbers to strings.
+** CHANGE it (undefine it) if you change LUA_NUMBER_FMT to something
+** that is not a '%g' format. After changing either one, check the
+** conversions with 'make PLATFORM ALL=numtest'.
+*/
+#define LUA_NUMBER_FMTPREC	14
+
 
 /*
 @@ lua_str2number converts a decimal numeric string to a number.
@@ -415,6 +445,15 @@
 */
 #define lua_str2number(s,p)	strtod((s), (p))
 
+/*
+@@ lua_getlocaledecpoint gets the locale "radix character" (decimal point).
+** CHANGE it if you do not want to use C locales. (Code using this macro
+** must include header 'locale.h'.)
+*/
+#if !defined(lua_getlocaledecpoint)
+#define lua_getlocaledecpoint()	(localeconv()->decimal_point[0])
+#endif
+
 #if defined(LUA_USE_STRTODHEX)
 #define lua_strx2number(s,p)	strtod((s), (p))
 #endif
@@ -29,6 +29,14 @@ LUAMOD_API int (luaopen_os) (lua_State *L);
 #define LUA_STRLIBNAME	"string"
 LUAMOD_API int (luaopen_string) (lua_State *L);
 
+/*
+** registry key of the pattern cache of the string library. Compiled
+** patterns depend on the LC_CTYPE locale; code that changes it should
+** flush the cache by giving this userdata a new (empty) uservalue
+** table, as 'os.setlocale' does.
+*/
+#define LUA_PATCACHEKEY	"_PATCACHE"
+
 #define LUA_BITLIBNAME	"bit32"
 LUAMOD_API int (luaopen_bit32) (lua_State *L);
 
@@ -14,6 +14,7 @@
 
 #include "lua.h"
 
+#include "lapi.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -50,7 +51,7 @@ int luaV_tostring (lua_State *L, StkId obj) {
   else {
     char s[LUAI_MAXNUMBER2STR];
     lua_Number n = nvalue(obj);
-    int l = lua_number2str(s, n);
+    int l = luaO_fmtnum(s, n, -1);
     setsvalue2s(L, obj, luaS_newlstr(L, s, l));
     return 1;
   }
@@ -215,11 +216,16 @@ static int call_orderTM (lua_State *L, const TValue *p1, const TValue *p2,
 }
 
 
-static int l_strcmp (const TString *ls, const TString *rs) {
+static int l_strcmp (lua_State *L, const TString *ls, const TString *rs) {
   const char *l = getstr(ls);
   size_t ll = ls->tsv.len;
   const char *r = getstr(rs);
   size_t lr = rs->tsv.len;
+  if (G(L)->collation == LUA_COLLBYTES) {  /* plain byte order? */
+    int temp = memcmp(l, r, (ll < lr) ? ll : lr);
+    if (temp != 0) return temp;
+    else return (ll == lr) ? 0 : (ll < lr) ? -1 : 1;  /* shorter is less */
+  }
   for (;;) {
     int temp = strcoll(l, r);
     if (temp != 0) return temp;
@@ -242,7 +248,7 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   if (ttisnumber(l) && ttisnumber(r))
     return luai_numlt(L, nvalue(l), nvalue(r));
   else if (ttisstring(l) && ttisstring(r))
-    return l_strcmp(rawtsvalue(l), rawtsvalue(r)) < 0;
+    return l_strcmp(L, rawtsvalue(l), rawtsvalue(r)) < 0;
   else if ((res = call_orderTM(L, l, r, TM_LT)) < 0)
     luaG_ordererror(L, l, r);
   return res;
@@ -254,7 +260,7 @@ int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r) {
   if (ttisnumber(l) && ttisnumber(r))
     return luai_numle(L, nvalue(l), nvalue(r));
   else if (ttisstring(l) && ttisstring(r))
-    return l_strcmp(rawtsvalue(l), rawtsvalue(r)) <= 0;
+    return l_strcmp(L, rawtsvalue(l), rawtsvalue(r)) <= 0;
   else if ((res = call_orderTM(L, l, r, TM_LE)) >= 0)  /* first try `le' */
     return res;
   else if ((res = call_orderTM(L, r, l, TM_LT)) < 0)  /* else try `lt' */
@@ -274,7 +280,7 @@ int luaV_equalobj_ (lua_State *L, const TValue *t1, const TValue *t2) {
     case LUA_TNUMBER: return luai_numeq(nvalue(t1), nvalue(t2));
     case LUA_TBOOLEAN: return bvalue(t1) == bvalue(t2);  /* true must be 1 !! */
     case LUA_TLIGHTUSERDATA: return pvalue(t1) == pvalue(t2);
-    case LUA_TLCF: return fvalue(t1) == fvalue(t2);
+    case LUA_TLCF: case LUA_TLLF: return fvalue(t1) == fvalue(t2);
     case LUA_TSHRSTR: return eqshrstr(rawtsvalue(t1), rawtsvalue(t2));
     case LUA_TLNGSTR: return luaS_eqlngstr(rawtsvalue(t1), rawtsvalue(t2));
     case LUA_TUSERDATA: {
@@ -496,6 +502,92 @@ void luaV_finishOp (lua_State *L) {
 }
 
 
+/*
+** call a leaf C function (see 'lua_pushleaffunction') without hooks:
+** as it does not yield nor call Lua itself, there is no need for the
+** general 'luaD_precall'/'luaD_poscall' protocol. Finalizers run by an
+** allocation inside it see 'ci' as a plain C frame; they cannot yield,
+** and an error from them unwinds 'ci' like any other C frame.
+*/
+static void leafcall (lua_State *L, StkId func, int nresults) {
+  CallInfo *ci = next_ci(L);
+  StkId res, firstResult;
+  int n;
+  ci->nresults = nresults;
+  ci->func = func;
+  ci->top = L->top + LUA_MINSTACK;
+  ci->callstatus = 0;
+  lua_unlock(L);
+  n = (*fvalue(func))(L);
+  lua_lock(L);
+  api_checknelems(L, n);
+  res = ci->func;  /* function may have moved the stack */
+  L->ci = ci->previous;
+  firstResult = L->top - n;
+  for (; nresults != 0 && firstResult < L->top; nresults--)
+    setobjs2s(L, res++, firstResult++);
+  while (nresults-- > 0)
+    setnilvalue(res++);
+  L->top = res;
+}
+
+
+/*
+** OP_VARSELECT: if R(A-2) is the base library 'select' and the selector
+** R(A-1) is '#' or a valid index, do the call that follows straight
+** from the varargs and return 1; otherwise return 0 to run the
+** instruction as OP_VARARG (and the call as usual)
+*/
+static int varselect (lua_State *L, CallInfo *ci, StkId ra) {
+  Table *reg = hvalue(&G(L)->l_registry);
+  const TValue *sel = luaH_getint(reg, LUA_RIDX_SELECT);
+  Instruction call = *ci->u.l.savedpc;
+  int wanted = GETARG_C(call) - 1;
+  int nv = nvarargs(ci, clLvalue(ci->func)->p->numparams);
+  int first, n, j;  /* first vararg to return (0 for '#') and how many */
+  StkId res = ra - 2;  /* results go where the function was */
+  lua_assert(GET_OPCODE(call) == OP_CALL || GET_OPCODE(call) == OP_TAILCALL);
+  if (!ttisleaf(res) || !ttisleaf(sel) || fvalue(res) != fvalue(sel))
+    return 0;
+  if (ttisstring(ra - 1) && *svalue(ra - 1) == '#') {
+    first = 0;
+    n = 1;
+  }
+  else if (ttisnumber(ra - 1)) {
+    lua_Integer k;
+    lua_number2integer(k, nvalue(ra - 1));
+    first = cast_int(k);
+    if (first < 0) first += nv + 1;
+    else if (first > nv + 1) first = nv + 1;
+    if (first < 1) return 0;  /* let 'select' raise the error */
+    n = nv + 1 - first;
+  }
+  else return 0;
+  if (wanted < 0) {  /* caller takes all results */
+    ptrdiff_t resr = savestack(L, res);
+    luaD_checkstack(L, n);
+    res = restorestack(L, resr);
+  }
+  else if (n > wanted) n = wanted;
+  if (first == 0) {
+    if (n > 0) setnvalue(res, cast_num(nv));
+  }
+  else {
+    StkId v = ci->u.l.base - nv + first - 1;
+    for (j = 0; j < n; j++)
+      setobjs2s(L, res + j, v + j);
+  }
+  if (wanted < 0)
+    L->top = res + n;
+  else {
+    for (j = n; j < wanted; j++)
+      setnilvalue(res + j);
+    L->top = ci->top;
+  }
+  return 1;
+}
+
+
 
 /*
 ** some macros for common tasks in `luaV_execute'
@@ -752,7 +844,13 @@ void luaV_execute (lua_State *L) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
-        if (luaD_precall(L, ra, nresults)) {  /* C function? */
+        if (ttisleaf(ra) && !L->hookmask &&
+            L->stack_last - L->top > LUA_MINSTACK) {  /* plain leaf call? */
+          Protect(leafcall(L, ra, nresults));
+          if (nresults >= 0) L->top = ci->top;  /* adjust results */
+        }
+        else if (luaD_precall(L, ra, nresults)) {  /* C function? */
+          if (L->status == LUA_YIELD) return;  /* back to 'resume' */
           if (nresults >= 0) L->top = ci->top;  /* adjust results */
           base = ci->u.l.base;
         }
@@ -774,8 +872,10 @@ void luaV_execute (lua_State *L) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         lua_assert(GETARG_C(i) - 1 == LUA_MULTRET);
-        if (luaD_precall(L, ra, LUA_MULTRET))  /* C function? */
+        if (luaD_precall(L, ra, LUA_MULTRET)) {  /* C function? */
+          if (L->status == LUA_YIELD) return;  /* back to 'resume' */
           base = ci->u.l.base;
+        }
         else {
 		  // 同上,precall已经把ci和stack准备好了
           /* tail call: put called frame (n) in place of caller one (o) */
@@ -910,6 +1010,14 @@ void luaV_execute (lua_State *L) {
           setclLvalue(L, ra, ncl);  /* push cashed closure */
         checkGC(L, ra + 1);
       )
+      vmcasenb(OP_VARSELECT,
+        if (!L->hookmask && varselect(L, ci, ra)) {
+          ci->u.l.savedpc++;  /* skip the call */
+          base = ci->u.l.base;
+          break;
+        }
+        /* else go through */
+      )
       vmcase(OP_VARARG,
         int b = GETARG_B(i) - 1;
         int j;
@@ -920,7 +1028,7 @@ void luaV_execute (lua_State *L) {
         // n此时为可变参数个数
 		// base - ci->func - 1 = 实际传递的参数
 		// cl->p->numparams = 固定参数
-        int n = cast_int(base - ci->func) - cl->p->numparams - 1;
+        int n = nvarargs(ci, cl->p->numparams);
         if (b < 0) {  /* B == 0? */
           b = n;  /* get all var. arguments */
           Protect(luaD_checkstack(L, n));